@@ -0,0 +1,4 @@
+// view-projection, uploaded once per frame
+layout (std140) uniform Camera {
+    mat4 VP;
+};
@@ -0,0 +1,21 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec3 fragColor;
+in vec2 fragCircleCoord;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Signed distance to the rim in radii, negative inside the disc
+    float distance = length(fragCircleCoord) - 1.0;
+
+    // Fade out over one pixel across the rim
+    float coverage = clamp(0.5 - distance / max(fwidth(distance), 1e-6), 0.0, 1.0);
+    if (coverage == 0.0)
+        discard;
+
+    color = vec4(fragColor, coverage);
+}
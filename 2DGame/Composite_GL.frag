@@ -0,0 +1,13 @@
+#version 330 core
+
+// Cached layer, same size as the framebuffer
+uniform sampler2D layer;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    // One texel per pixel, no filtering
+    color = texelFetch(layer, ivec2(gl_FragCoord.xy), 0).rgb;
+}
@@ -4,12 +4,29 @@
 #include <fstream>
 #include <vector>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include "Particles.h"
 #define EXIT_SUCCESS 0
 #define EXIT_FAILURE 1
 using namespace std;
@@ -28,6 +45,35 @@ struct VAO {
 
     GLfloat radius;
     bool scorable;
+
+    // Flat colour and shape, used by the instanced obstacle batch
+    GLfloat red;
+    GLfloat green;
+    GLfloat blue;
+    bool circle;
+
+    // Packed format: 2D positions only, colour is set per draw
+    bool Compact;
+    GLfloat PositionOffset[2];  // undo the 16-bit quantization:
+    GLfloat PositionScale[2];   // position = offset + packed * scale
+
+    // Indexed geometry: NumIndices GLushort indices into the vertices, 0 draws them in order
+    GLuint IndexBuffer;
+    int NumIndices;
+
+    // Geometry is a unit mesh from the mesh cache, owned by the cache
+    bool Shared;
+    int Sides;   // fan circles from the cache: full side count, a level of detail is picked per draw
+
+    // Circle drawn as a quad, the disc is computed in the fragment shader
+    bool Sdf;
+
+    // Bounding circle (x_centre, y_centre, radius) is outside the view
+    bool Culled;
+
+    // obs and Culled as of the frame being rendered, owned by the renderer
+    bool DrawnAlive;
+    bool DrawnCulled;
 };
 typedef struct VAO VAO;
 
@@ -35,41 +81,533 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
+	GLuint CameraBuffer;     // UBO - "Camera" block, view-projection for the frame
+	GLuint TransformBuffer;  // UBO - "Transforms" block, per-object 2D transforms
+	int TransformBlocks;     // blocks of MAX_OBJECT_TRANSFORMS the TransformBuffer holds
 } Matrices;
 
-GLuint programID;
+GLuint programID, instancedProgramID, circleProgramID;
+
+// Vertex format used by create3DObject - the split xyz/rgb VBOs are kept for comparison
+bool compactVertices = true;
+bool quantizeVertices = false;
+
+/* GL render-state tracker */
+/* Shadows the state the game changes and drops calls that would not change it.
+   Every state change in this file goes through the state* functions below so
+   the shadow never goes stale. */
+#define MAX_TRACKED_ATTRIBS 8
+
+struct GLStateCache {
+    GLuint program;
+    GLuint vertexArray;
+    GLenum polygonMode;
+    GLuint arrayBuffer;
+    GLuint uniformBuffer;
+    GLuint framebuffer;              // GL_DRAW_FRAMEBUFFER
+    GLuint readFramebuffer;          // GL_READ_FRAMEBUFFER
+    GLuint texture;                  // GL_TEXTURE_2D on unit 0
+    bool blend;
+    bool scissorTest;
+    vector<unsigned> attribEnabled;  // per VAO name, one bit per attribute array
+
+    // Current values of the generic attributes used as per-draw constants
+    GLfloat color[3];
+    bool colorValid;
+    GLint objectIndex;
+    bool objectIndexValid;
+
+    // Counters for the frame being built and the last finished frame
+    int issued, skipped, draws, indices;   // array draws count a vertex as an index
+    int lastIssued, lastSkipped, lastDraws, lastIndices;
+} glState;
+
+bool showGLStats = false;
+
+void stateBeginFrame ()
+{
+    glState.lastIssued = glState.issued;
+    glState.lastSkipped = glState.skipped;
+    glState.lastDraws = glState.draws;
+    glState.lastIndices = glState.indices;
+    glState.issued = glState.skipped = glState.draws = glState.indices = 0;
+}
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+/* Count one call - returns true when it has to reach the driver */
+bool stateChanged (bool changed)
+{
+    if (changed)
+        glState.issued++;
+    else
+        glState.skipped++;
+    return changed;
+}
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+void stateUseProgram (GLuint program)
+{
+    if (stateChanged(glState.program != program)) {
+        glUseProgram(program);
+        glState.program = program;
+    }
+}
+
+void stateBindVertexArray (GLuint vertexArray)
+{
+    if (stateChanged(glState.vertexArray != vertexArray)) {
+        glBindVertexArray(vertexArray);
+        glState.vertexArray = vertexArray;
+    }
+    if (glState.attribEnabled.size() <= vertexArray)
+        glState.attribEnabled.resize(vertexArray + 1, 0);
+}
+
+void statePolygonMode (GLenum mode)
+{
+    if (stateChanged(glState.polygonMode != mode)) {
+        glPolygonMode(GL_FRONT_AND_BACK, mode);
+        glState.polygonMode = mode;
+    }
+}
+
+void stateBindBuffer (GLenum target, GLuint buffer)
+{
+    GLuint* bound = target == GL_UNIFORM_BUFFER ? &glState.uniformBuffer : &glState.arrayBuffer;
+    if (target != GL_ARRAY_BUFFER && target != GL_UNIFORM_BUFFER) {
+        // Not shadowed, always goes through
+        stateChanged(true);
+        glBindBuffer(target, buffer);
+        return;
+    }
+    if (stateChanged(*bound != buffer)) {
+        glBindBuffer(target, buffer);
+        *bound = buffer;
+    }
+}
+
+/* Draw and read from framebuffer */
+void stateBindFramebuffer (GLuint framebuffer)
+{
+    if (stateChanged(glState.framebuffer != framebuffer || glState.readFramebuffer != framebuffer)) {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glState.framebuffer = framebuffer;
+        glState.readFramebuffer = framebuffer;
+    }
+}
+
+/* Where glBlitFramebuffer and glReadPixels read from, the draw framebuffer stays */
+void stateBindReadFramebuffer (GLuint framebuffer)
+{
+    if (stateChanged(glState.readFramebuffer != framebuffer)) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glState.readFramebuffer = framebuffer;
+    }
+}
+
+void stateBindTexture (GLuint texture)
+{
+    if (stateChanged(glState.texture != texture)) {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glState.texture = texture;
+    }
+}
+
+void stateBindBufferBase (GLenum target, GLuint index, GLuint buffer)
+{
+    // Also binds the generic binding point, keep the shadow in sync
+    stateChanged(true);
+    glBindBufferBase(target, index, buffer);
+    if (target == GL_UNIFORM_BUFFER)
+        glState.uniformBuffer = buffer;
+}
+
+void stateBindBufferRange (GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    // Also binds the generic binding point, keep the shadow in sync
+    stateChanged(true);
+    glBindBufferRange(target, index, buffer, offset, size);
+    if (target == GL_UNIFORM_BUFFER)
+        glState.uniformBuffer = buffer;
+}
+
+void stateBlend (bool blend)
+{
+    if (stateChanged(glState.blend != blend)) {
+        if (blend)
+            glEnable(GL_BLEND);
+        else
+            glDisable(GL_BLEND);
+        glState.blend = blend;
+    }
+}
+
+void stateScissorTest (bool scissorTest)
+{
+    if (stateChanged(glState.scissorTest != scissorTest)) {
+        if (scissorTest)
+            glEnable(GL_SCISSOR_TEST);
+        else
+            glDisable(GL_SCISSOR_TEST);
+        glState.scissorTest = scissorTest;
+    }
+}
+
+/* Enable an attribute array of the bound VAO */
+void stateEnableVertexAttribArray (GLuint index)
+{
+    unsigned& enabled = glState.attribEnabled[glState.vertexArray];
+    if (stateChanged(!(enabled & (1u << index)))) {
+        glEnableVertexAttribArray(index);
+        enabled |= 1u << index;
+    }
+}
+
+/* Per-draw constant colour, generic attribute 1 */
+void stateVertexColor (GLfloat red, GLfloat green, GLfloat blue)
+{
+    bool same = glState.colorValid && glState.color[0] == red && glState.color[1] == green && glState.color[2] == blue;
+    if (stateChanged(!same)) {
+        glVertexAttrib3f(1, red, green, blue);
+        glState.color[0] = red;
+        glState.color[1] = green;
+        glState.color[2] = blue;
+        glState.colorValid = true;
+    }
+}
+
+/* Per-draw transform index, generic attribute 3 */
+void stateObjectIndex (GLint index)
+{
+    if (stateChanged(!glState.objectIndexValid || glState.objectIndex != index)) {
+        glVertexAttribI1i(3, index);
+        glState.objectIndex = index;
+        glState.objectIndexValid = true;
+    }
+}
+
+/* Drawing with an attribute array enabled leaves that attribute's current value undefined */
+void stateAfterDraw ()
+{
+    unsigned enabled = glState.attribEnabled[glState.vertexArray];
+    if (enabled & (1u << 1))
+        glState.colorValid = false;
+    if (enabled & (1u << 3))
+        glState.objectIndexValid = false;
+    glState.draws++;
+}
+
+void stateDrawArrays (GLenum mode, GLint first, GLsizei count)
+{
+    glDrawArrays(mode, first, count);
+    glState.indices += count;
+    stateAfterDraw();
+}
+
+void stateDrawArraysInstanced (GLenum mode, GLint first, GLsizei count, GLsizei instances)
+{
+    glDrawArraysInstanced(mode, first, count, instances);
+    glState.indices += count * instances;
+    stateAfterDraw();
+}
+
+void stateMultiDrawArrays (GLenum mode, const GLint* first, const GLsizei* count, GLsizei drawcount)
+{
+    glMultiDrawArrays(mode, first, count, drawcount);
+    for (GLsizei i = 0; i < drawcount; i++)
+        glState.indices += count[i];
+    stateAfterDraw();
+}
+
+void stateDrawElements (GLenum mode, GLsizei count, GLenum type, const GLvoid* indices)
+{
+    glDrawElements(mode, count, type, indices);
+    glState.indices += count;
+    stateAfterDraw();
+}
+
+void stateDrawElementsBaseVertex (GLenum mode, GLsizei count, GLenum type, const GLvoid* indices, GLint basevertex)
+{
+    glDrawElementsBaseVertex(mode, count, type, (GLvoid*) indices, basevertex);
+    glState.indices += count;
+    stateAfterDraw();
+}
+
+void stateDrawElementsInstanced (GLenum mode, GLsizei count, GLenum type, const GLvoid* indices, GLsizei instances)
+{
+    glDrawElementsInstanced(mode, count, type, indices, instances);
+    glState.indices += count * instances;
+    stateAfterDraw();
+}
+
+void stateMultiDrawElements (GLenum mode, const GLsizei* count, GLenum type, const GLvoid* const* indices, GLsizei drawcount)
+{
+    glMultiDrawElements(mode, count, type, indices, drawcount);
+    for (GLsizei i = 0; i < drawcount; i++)
+        glState.indices += count[i];
+    stateAfterDraw();
+}
+
+/* Start from the GL defaults */
+void initStateCache ()
+{
+    glState.program = 0;
+    glState.vertexArray = 0;
+    glState.polygonMode = GL_FILL;
+    glState.arrayBuffer = 0;
+    glState.uniformBuffer = 0;
+    glState.framebuffer = 0;
+    glState.readFramebuffer = 0;
+    glState.texture = 0;
+    glState.blend = false;
+    glState.scissorTest = false;
+    glState.attribEnabled.assign(1, 0);
+    glState.colorValid = false;
+    glState.objectIndexValid = false;
+    glState.issued = glState.skipped = glState.draws = glState.indices = 0;
+}
+
+/* Program binary cache */
+/* Linked programs are saved with glGetProgramBinary and loaded back with
+   glProgramBinary on the next start, which skips compiling and linking. The file
+   name is a 64-bit FNV-1a hash of both sources and the GL vendor, renderer and
+   version strings, so editing a shader or changing the driver misses the cache.
+   A binary the driver rejects is compiled from source again and replaced. */
+struct ProgramCache {
+    bool enabled;
+    string directory;
+} programCache = { true, ".shadercache" };
+
+unsigned long long fnv1a (const string& data, unsigned long long hash = 14695981039346656037ULL)
+{
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* Check the driver can hand out binaries at all, once the context exists */
+void initProgramCache ()
+{
+  GLint formats = 0;
+  if (programCache.enabled && GLAD_GL_ARB_get_program_binary)
+    glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  programCache.enabled = formats > 0;
+  if (programCache.enabled)
+    mkdir(programCache.directory.c_str(), 0755);
+}
+
+string programCachePath (const string& vertexCode, const string& fragmentCode)
+{
+  // Separators keep "ab"+"c" and "a"+"bc" apart
+  unsigned long long hash = fnv1a(vertexCode);
+  hash = fnv1a(string(1, '\0') + fragmentCode, hash);
+  hash = fnv1a(string(1, '\0') + (const char*) glGetString(GL_VENDOR), hash);
+  hash = fnv1a(string(1, '\0') + (const char*) glGetString(GL_RENDERER), hash);
+  hash = fnv1a(string(1, '\0') + (const char*) glGetString(GL_VERSION), hash);
+
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.bin", hash);
+  return programCache.directory + name;
+}
+
+/* Returns the program, or 0 when there is no usable binary */
+GLuint loadCachedProgram (const string& path)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return 0;
+
+  GLenum format;
+  vector<char> binary;
+  if (fread(&format, sizeof(format), 1, file) == 1)
+  {
+    long start = ftell(file);
+    fseek(file, 0, SEEK_END);
+    binary.resize(max(ftell(file) - start, 0L));
+    fseek(file, start, SEEK_SET);
+    if (!binary.empty() && fread(&binary[0], binary.size(), 1, file) != 1)
+      binary.clear();
+  }
+  fclose(file);
+  if (binary.empty())
+    return 0;
+
+  GLuint ProgramID = glCreateProgram();
+  glProgramBinary(ProgramID, format, &binary[0], binary.size());
+
+  GLint Result = GL_FALSE;
+  glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+  if (!Result)
+  {
+    // Usually a driver update the version string did not catch
+    glDeleteProgram(ProgramID);
+    return 0;
+  }
+  return ProgramID;
+}
+
+void saveCachedProgram (const string& path, GLuint ProgramID)
+{
+  GLint length = 0;
+  glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  GLenum format;
+  vector<char> binary(length);
+  glGetProgramBinary(ProgramID, length, NULL, &format, &binary[0]);
+
+  // Written under a temporary name, so a crash never leaves half a binary behind
+  string temporary = path + ".tmp";
+  FILE* file = fopen(temporary.c_str(), "wb");
+  if (!file)
+    return;
+  bool written = fwrite(&format, sizeof(format), 1, file) == 1 && fwrite(&binary[0], length, 1, file) == 1;
+  if (fclose(file) == 0 && written)
+    rename(temporary.c_str(), path.c_str());
+  else
+    remove(temporary.c_str());
+}
+
+/* Print a shader or program info log, unless it is empty */
+void printInfoLog (const vector<char>& log)
+{
+  if (log.size() > 1 && log[0])
+    fprintf(stdout, "%s\n", &log[0]);
+}
+
+void printProgramLog (GLuint ProgramID)
+{
+  GLint InfoLogLength = 0;
+  glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+  vector<char> log( max(InfoLogLength, int(1)) );
+  glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &log[0]);
+  printInfoLog(log);
+}
+
+void printShaderLog (GLuint ShaderID)
+{
+  GLint InfoLogLength = 0;
+  glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+  vector<char> log( max(InfoLogLength, int(1)) );
+  glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &log[0]);
+  printInfoLog(log);
+}
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
+/* Read a shader source file, empty if it cannot be opened */
+std::string readShaderSource (const char * file_path)
+{
+	std::string ShaderCode;
+	std::ifstream ShaderStream(file_path, std::ios::in);
+	if(ShaderStream.is_open())
 	{
 		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+		while(getline(ShaderStream, Line))
+			ShaderCode += "\n" + Line;
+		ShaderStream.close();
 	}
+	return ShaderCode;
+}
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+/* Shader preprocessing */
+/* Sources are preprocessed before they are compiled, at startup and on hot
+   reload alike: an #include "file" line is replaced by that file, looked up
+   next to the shader including it, and shaderDefines - the constants the
+   shaders share with this file - goes in right after the #version line. */
+#define MAX_SHADER_INCLUDE_DEPTH 8
+
+string shaderDefines;  // set before the first shader is loaded, read-only afterwards
+
+string directoryOf (const string& path)
+{
+  size_t slash = path.rfind('/');
+  return slash == string::npos ? "." : path.substr(0, slash);
+}
+
+/* Append the source of path to code with its includes expanded, every file read goes into files */
+bool expandShaderIncludes (const string& path, string& code, vector<string>& files, int depth)
+{
+  files.push_back(path);
+  string source = readShaderSource(path.c_str());
+  if (source.empty())
+  {
+    fprintf(stderr, "Shader preprocessing: cannot read %s\n", path.c_str());
+    return false;
+  }
+
+  string directory = directoryOf(path);
+  size_t start = 0;
+  while (start < source.size())
+  {
+    size_t end = source.find('\n', start + 1);
+    if (end == string::npos)
+      end = source.size();
+    string line = source.substr(start, end - start);
+    start = end;
+
+    size_t directive = line.find_first_not_of(" \t\n");
+    if (directive == string::npos || line.compare(directive, 8, "#include") != 0)
+    {
+      code += line;
+      continue;
+    }
+
+    size_t open = line.find('"', directive), close = line.rfind('"');
+    if (open == string::npos || close <= open || depth == MAX_SHADER_INCLUDE_DEPTH)
+    {
+      fprintf(stderr, "Shader preprocessing: bad or too deeply nested %s in %s\n", line.c_str() + directive, path.c_str());
+      return false;
+    }
+    string name = line.substr(open + 1, close - open - 1);
+    code += "\n";
+    if (!expandShaderIncludes(directory == "." ? name : directory + "/" + name, code, files, depth + 1))
+      return false;
+  }
+  return true;
+}
+
+/* The preprocessed source of a shader file, empty if it or one of its includes
+   cannot be read. files, if given, gets every file the source was made from */
+string preprocessShader (const char* path, vector<string>* files = NULL)
+{
+  string code;
+  vector<string> read;
+  bool expanded = expandShaderIncludes(path, code, read, 0);
+  if (files)
+    *files = read;
+  if (!expanded)
+    return "";
+
+  // #version has to stay the first thing in the source
+  size_t version = code.find("#version");
+  size_t after = version == string::npos ? 0 : code.find('\n', version);
+  code.insert(after == string::npos ? code.size() : after, "\n" + shaderDefines);
+  return code;
+}
+
+/* Function to load Shaders - Use it as it is */
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+
+	// Read the shader code from the files
+	std::string VertexShaderCode = preprocessShader(vertex_file_path);
+	std::string FragmentShaderCode = preprocessShader(fragment_file_path);
+
+	// A binary saved by an earlier run skips the compile and link below
+	std::string CachePath;
+	if (programCache.enabled)
+	{
+		CachePath = programCachePath(VertexShaderCode, FragmentShaderCode);
+		GLuint CachedProgramID = loadCachedProgram(CachePath);
+		if (CachedProgramID)
+			return CachedProgramID;
 	}
 
+	// Create the shaders
+	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+
 	GLint Result = GL_FALSE;
-	int InfoLogLength;
 
 	// Compile Vertex Shader
 	printf("Compiling shader : %s\n", vertex_file_path);
@@ -79,10 +617,7 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 
 	// Check Vertex Shader
 	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
+	printShaderLog(VertexShaderID);
 
 	// Compile Fragment Shader
 	printf("Compiling shader : %s\n", fragment_file_path);
@@ -92,28 +627,27 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 
 	// Check Fragment Shader
 	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
+	printShaderLog(FragmentShaderID);
 
 	// Link the program
 	fprintf(stdout, "Linking program\n");
 	GLuint ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
+	if (programCache.enabled)
+		glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ProgramID);
 
 	// Check the program
 	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+	printProgramLog(ProgramID);
 
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
 
+	if (programCache.enabled && Result)
+		saveCachedProgram(CachePath, ProgramID);
+
 	return ProgramID;
 }
 
@@ -122,22 +656,49 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+void stopCapture ();
+void stopRenderThread ();
+void stopShaderReload ();
+void writeGpuProfile ();
+void cyclePacing ();
+
 void quit(GLFWwindow *window)
 {
+    stopRenderThread();
+    stopShaderReload();
+    stopCapture();
+    writeGpuProfile();
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
 
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+struct VAO* createCompact3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode);
+
+/* A VAO handle with no GL objects yet: a plain, unindexed shape of one colour, in view and standing */
+struct VAO* allocate3DObject (GLenum primitive_mode, int numVertices, GLenum fill_mode, GLfloat red, GLfloat green, GLfloat blue)
 {
-    struct VAO* vao = new struct VAO;
+    struct VAO* vao = new struct VAO();
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
-    
+    vao->red = red;
+    vao->green = green;
+    vao->blue = blue;
+    vao->DrawnAlive = true;
+    vao->PositionScale[0] = vao->PositionScale[1] = 1;
+    return vao;
+}
+
+/* Generate VAO, VBOs and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+    // Every shape is a single flat colour, so the compact format keeps only the first one
+    if (compactVertices)
+        return createCompact3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data[0], color_buffer_data[1], color_buffer_data[2], fill_mode);
+
+    struct VAO* vao = allocate3DObject(primitive_mode, numVertices, fill_mode, color_buffer_data[0], color_buffer_data[1], color_buffer_data[2]);
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
@@ -145,8 +706,8 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
     glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
+    stateBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
                           0,                  // attribute 0. Vertices
@@ -157,7 +718,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           (void*)0            // array buffer offset
                           );
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
     glVertexAttribPointer(
                           1,                  // attribute 1. Color
@@ -171,9 +732,61 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     return vao;
 }
 
+/* Generate VAO and a single packed VBO of 2D positions - Common Color set per draw */
+struct VAO* createCompact3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode)
+{
+    struct VAO* vao = allocate3DObject(primitive_mode, numVertices, fill_mode, red, green, blue);
+    vao->Compact = true;
+
+    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - packed positions
+
+    stateBindVertexArray (vao->VertexArrayID); // Bind the VAO
+    stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
+
+    if (quantizeVertices) {
+        // Map the bounding box of the shape onto the signed 16-bit range
+        GLfloat minX = vertex_buffer_data[0], maxX = minX;
+        GLfloat minY = vertex_buffer_data[1], maxY = minY;
+        for (int i=1; i<numVertices; i++) {
+            minX = min(minX, vertex_buffer_data[3*i]);
+            maxX = max(maxX, vertex_buffer_data[3*i]);
+            minY = min(minY, vertex_buffer_data[3*i + 1]);
+            maxY = max(maxY, vertex_buffer_data[3*i + 1]);
+        }
+        vao->PositionOffset[0] = (minX + maxX) / 2;
+        vao->PositionOffset[1] = (minY + maxY) / 2;
+        vao->PositionScale[0] = max((maxX - minX) / 2, 1e-6f);
+        vao->PositionScale[1] = max((maxY - minY) / 2, 1e-6f);
+
+        std::vector<GLshort> packed(2*numVertices);
+        for (int i=0; i<numVertices; i++) {
+            packed[2*i] = (GLshort) lround((vertex_buffer_data[3*i] - vao->PositionOffset[0]) / vao->PositionScale[0] * 32767);
+            packed[2*i + 1] = (GLshort) lround((vertex_buffer_data[3*i + 1] - vao->PositionOffset[1]) / vao->PositionScale[1] * 32767);
+        }
+        glBufferData (GL_ARRAY_BUFFER, packed.size()*sizeof(GLshort), &packed[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 2, GL_SHORT, GL_TRUE, 0, (void*)0); // attribute 0. Vertices (x,y) as normalized shorts
+    }
+    else {
+        std::vector<GLfloat> packed(2*numVertices);
+        for (int i=0; i<numVertices; i++) {
+            packed[2*i] = vertex_buffer_data[3*i];
+            packed[2*i + 1] = vertex_buffer_data[3*i + 1];
+        }
+        glBufferData (GL_ARRAY_BUFFER, packed.size()*sizeof(GLfloat), &packed[0], GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0); // attribute 0. Vertices (x,y)
+    }
+    stateEnableVertexAttribArray(0);
+
+    return vao;
+}
+
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
+    if (compactVertices)
+        return createCompact3DObject(primitive_mode, numVertices, vertex_buffer_data, red, green, blue, fill_mode);
+
     GLfloat* color_buffer_data = new GLfloat [3*numVertices];
     for (int i=0; i<numVertices; i++) {
         color_buffer_data [3*i] = red;
@@ -181,30 +794,41 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    struct VAO* vao = create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    delete [] color_buffer_data;
+    return vao;
 }
 
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
+    // SDF circles blend their antialiased rim over what is behind them
+    stateUseProgram (vao->Sdf ? circleProgramID : programID);
+    stateBlend (vao->Sdf);
+
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    statePolygonMode (vao->FillMode);
 
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    // Bind the VAO to use - it already references its VBOs
+    stateBindVertexArray (vao->VertexArrayID);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    if (vao->Compact) {
+        // Attribute 1 has no array in the packed format - one colour for the whole draw
+        stateVertexColor(vao->red, vao->green, vao->blue);
+    }
+    else {
+        // Enable Vertex Attribute 0 - 3d Vertices
+        stateEnableVertexAttribArray(0);
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+        // Enable Vertex Attribute 1 - Color
+        stateEnableVertexAttribArray(1);
+    }
 
     // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    if (vao->NumIndices)
+        stateDrawElements(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)0);  // the VAO references its index buffer
+    else
+        stateDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
 }
 
 /**************************
@@ -220,6 +844,108 @@ float triangle_translationY;
 VAO* Obstacles[100];
 int add = 0;
 float zoom = 1;
+
+/* The static scene is rendered once into a texture the size of the framebuffer
+   and composited each frame with one fullscreen triangle. */
+struct StaticLayer {
+    GLuint Framebuffer;
+    GLuint Texture;
+    GLuint VertexArrayID;  // empty, the triangle comes from gl_VertexID
+    int width;
+    int height;
+    glm::mat4 VP;          // view-projection it was rendered with
+    bool dirty;
+} staticLayer;
+
+bool staticLayerEnabled = true;
+void resizeStaticLayer (int width, int height);
+
+// Framebuffer the frame is drawn into - the window's, or the offscreen one when headless
+GLuint screenFramebuffer = 0;
+int framebufferWidth, framebufferHeight;
+
+// Framebuffer size as last reported to the simulation, the renderer catches up with it
+int viewWidth, viewHeight;
+
+// Framebuffer the scene is drawn into - screenFramebuffer, or the scaled target of dynamic resolution
+GLuint sceneFramebuffer = 0;
+int sceneWidth, sceneHeight;
+void resizeSceneTarget (int width, int height);
+
+/* Damage tracking - whatever changes what is on screen marks it here, and the
+   main loop only renders and swaps while something is marked. The render thread
+   marks it too, after a shader reload or a change of resolution. */
+enum Damage {
+    DAMAGE_VIEW = 1,         // zoom, resize or the window needs repainting
+    DAMAGE_AIM = 2,          // barrel rotation
+    DAMAGE_POWER_BAR = 4,    // sx oscillation
+    DAMAGE_PROJECTILE = 8,   // cannonball moved
+    DAMAGE_OBSTACLES = 16,   // an obstacle was hit
+    DAMAGE_HUD = 32,         // the HUD text changed, e.g. the frame rate
+    DAMAGE_PARTICLES = 64,   // an impact burst is still flying
+    DAMAGE_ALL = 127
+};
+
+atomic<unsigned> sceneDamage(DAMAGE_ALL);
+bool damageTracking = true;
+
+void markDamage (unsigned damage)
+{
+  sceneDamage |= damage;
+}
+
+/* Partial redraws */
+/* While the player aims, the power bar and the HUD text are all that change.
+   When dynamic resolution draws the scene into its own target, that target
+   still holds the last frame, so such a frame only redraws the rectangle the
+   bar covered and now covers, under the scissor test, before the target is
+   blitted to the framebuffer and the HUD drawn on top as usual. Drawn straight
+   to the framebuffer, the scene is redrawn whole: the back buffer is undefined
+   after a swap, and keeping a copy costs a full screen blit, as much as the
+   redraw over the cached static layer. */
+#define PARTIAL_DAMAGE (DAMAGE_POWER_BAR | DAMAGE_HUD)
+#define PARTIAL_MARGIN 2  // pixels around the bar, for rounding and antialiasing
+
+// Marked since the renderer last took a packet, ORed in before each publish
+atomic<unsigned> presentDamage(DAMAGE_ALL);
+
+struct PartialRedraw {
+    bool kept;         // the scene target holds the last frame drawn
+    GLint bar[4];      // where the bar is in it, x0 y0 x1 y1 in scene pixels
+    bool active;       // the scene of this frame is scissored
+} partialRedraw;
+
+/* Scissor the scene to the power bar if nothing else changed since the last frame drawn */
+void beginPartialRedraw (const glm::mat4& VP, const GLfloat powerBar[4], unsigned damage)
+{
+  glm::vec4 low = VP * glm::vec4(powerBar[0], powerBar[1], 0, 1);
+  glm::vec4 high = VP * glm::vec4(powerBar[2], powerBar[3], 0, 1);
+  GLint bar[4] = {
+    (GLint) floor((min(low.x, high.x) * 0.5f + 0.5f) * sceneWidth) - PARTIAL_MARGIN,
+    (GLint) floor((min(low.y, high.y) * 0.5f + 0.5f) * sceneHeight) - PARTIAL_MARGIN,
+    (GLint) ceil((max(low.x, high.x) * 0.5f + 0.5f) * sceneWidth) + PARTIAL_MARGIN,
+    (GLint) ceil((max(low.y, high.y) * 0.5f + 0.5f) * sceneHeight) + PARTIAL_MARGIN
+  };
+
+  partialRedraw.active = partialRedraw.kept && (damage & ~PARTIAL_DAMAGE) == 0;
+  if (partialRedraw.active)
+  {
+    GLint x0 = min(bar[0], partialRedraw.bar[0]), y0 = min(bar[1], partialRedraw.bar[1]);
+    GLint x1 = max(bar[2], partialRedraw.bar[2]), y1 = max(bar[3], partialRedraw.bar[3]);
+    stateScissorTest (true);
+    glScissor (x0, y0, max(0, x1 - x0), max(0, y1 - y0));
+  }
+
+  copy(bar, bar + 4, partialRedraw.bar);
+  partialRedraw.kept = sceneFramebuffer != screenFramebuffer;
+}
+
+void endPartialRedraw ()
+{
+  stateScissorTest (false);
+  partialRedraw.active = false;
+}
+
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -239,11 +965,15 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
             case GLFW_KEY_ESCAPE:
                 quit(window);
                 break;
+            case GLFW_KEY_V:
+                cyclePacing();
+                break;
             case GLFW_KEY_Z:
               if(zoom < 1)
               {
                 zoom = zoom + 0.005;
                 Matrices.projection = glm::ortho(-zoom*4.0f, zoom*4.0f, -zoom*4.0f, zoom*4.0f, 0.1f, 500.0f);
+                markDamage(DAMAGE_VIEW);
               }
               break;
             case GLFW_KEY_X:
@@ -251,6 +981,7 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
               {
                 zoom -= 0.005;
                 Matrices.projection = glm::ortho(-zoom*4.0f, zoom*4.0f, -zoom*4.0f, zoom*4.0f, 0.1f, 500.0f);
+                markDamage(DAMAGE_VIEW);
               }
               break;
             default:
@@ -270,14 +1001,17 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
             break;
     case ' ':
             space=1;
+            markDamage(DAMAGE_PROJECTILE);
             break;
     case 'a':
             rectangle_rot_dir=1;
             rectangle_rot_status=true;
+            markDamage(DAMAGE_AIM);
             break;
     case 'd':
             rectangle_rot_dir=-1;
             rectangle_rot_status=true;
+            markDamage(DAMAGE_AIM);
             break;
 		default:
 			break;
@@ -305,12 +1039,15 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     int fbwidth=width, fbheight=height;
     /* With Retina display on Mac OS X, GLFW's FramebufferSize
      is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    if (window) {
+        glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    }
 
 	GLfloat fov = 90.0f;
 
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) fbwidth, (GLsizei) fbheight);
+	// The viewport and render targets follow in the first frame drawn at this size
+    viewWidth = fbwidth;
+    viewHeight = fbheight;
 
 	// set the projection matrix as perspective
 	/* glMatrixMode (GL_PROJECTION);
@@ -322,6 +1059,25 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 
     // Ortho projection for 2D views
     Matrices.projection = glm::ortho(-zoom*4.0f, zoom*4.0f, -zoom*4.0f, zoom*4.0f, 0.1f, 500.0f);
+
+    markDamage(DAMAGE_VIEW);
+}
+
+/* Resize everything the renderer draws into, before drawing a frame of a new size */
+void resizeFramebuffer (int width, int height)
+{
+    glViewport (0, 0, (GLsizei) width, (GLsizei) height);
+    framebufferWidth = width;
+    framebufferHeight = height;
+
+    // The scene target and the cached static layer follow the framebuffer size
+    resizeSceneTarget(width, height);
+}
+
+/* Executed when the window contents were lost, e.g. after being uncovered */
+void refreshWindow (GLFWwindow* window)
+{
+    markDamage(DAMAGE_VIEW);
 }
 
 VAO *triangle,*circle1, *circle2,  *circle3, *circle4,*circle5, *rectangle, *cannon, *circle6, *circle7,*circle8;
@@ -353,173 +1109,404 @@ int countt;
 // }
 
 
-void drawCannon( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
-{
-  int numberOfVertices = numberOfSides + 2;
+/* Mesh cache */
+/* Shapes that differ only in position, size and colour share one unit mesh,
+   tessellated and uploaded the first time it is asked for - one circle per
+   number of sides, one quad. An object made from a mesh is only a VAO struct
+   pointing at it, placed through PositionOffset/PositionScale the same way the
+   quantized format is. Shared meshes always hold plain 2D floats: there is one
+   of each, so packing them would save nothing. They are indexed triangle lists,
+   every corner stored once; all quads share one index buffer. */
+#define CIRCLE_QUAD_EXTENT 1.5f  // see Circles below
+#define QUAD_INDEX_QUADS 1024    // quads the shared index buffer reaches, 4 vertices each
+
+enum MeshShape {
+    MESH_CIRCLE,       // centre and sides rim points at radius 1, a triangle to each rim edge
+    MESH_QUAD,         // [-1, 1] x [-1, 1]
+    MESH_CIRCLE_QUAD   // corners CIRCLE_QUAD_EXTENT out, for SDF circles
+};
 
-  GLfloat twicePi = 2.0f * M_PI;
+struct Mesh {
+    MeshShape Shape;
+    int Sides;
+    GLuint VertexArrayID;
+    GLuint VertexBuffer;
+    GLuint IndexBuffer;   // GLushort triangles
+    GLenum PrimitiveMode;
+    int NumVertices;
+    int NumIndices;
+};
 
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
+deque<Mesh> meshCache;  // a deque so the Mesh pointers handed out stay valid
 
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
+/* Unit mesh tables */
+/* The vertices and indices of the standard circle tessellations - the full
+   360-sided circle and its levels of detail - and of the quads are worked out
+   by the compiler and baked into the binary, so building those meshes is a
+   glBufferData from read-only data. The standard library trig is not
+   constexpr, hence the series. */
 
-  for ( int i = 1; i < numberOfVertices; i++ )
-  {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
+// x in [-pi, pi], the series are good to double precision over that range
+constexpr double tableSin (double x)
+{
+  double term = x, sum = x;
+  for (int k = 1; k < 20; k++) {
+    term *= -x*x / ((2*k) * (2*k + 1));
+    sum += term;
   }
+  return sum;
+}
 
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
-
-  for ( int i = 0; i < numberOfVertices; i++ )
-  {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
+constexpr double tableCos (double x)
+{
+  double term = 1, sum = 1;
+  for (int k = 1; k < 20; k++) {
+    term *= -x*x / ((2*k - 1) * (2*k));
+    sum += term;
   }
-
-    // glEnableClientState( GL_VERTEX_ARRAY );
-    //     glVertexPointer( 3, GL_FLOAT, 0, allCircleVertices );
-    //     glDrawArrays( GL_TRIANGLE_FAN, 0, numberOfVertices);
-    // glDisableClientState( GL_VERTEX_ARRAY );
-  cannon = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
-  
-  cannon->obs = obs;
-  cannon->radius = radius;
-  cannon->x_centre = x;
-  cannon->y_centre = y;
+  return sum;
 }
 
-
-void drawCircle1( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
+constexpr double tableAngle (double x)
 {
-  int numberOfVertices = numberOfSides + 2;
-
-  GLfloat twicePi = 2.0f * M_PI;
-
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
+  return x > M_PI ? x - 2*M_PI : x;
+}
 
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
+// Centre, then Sides+1 rim points from 2pi/Sides on - the fan the circles always had, the
+// split format still draws it. The indexed circle uses the first Sides+1 vertices.
+template <int Sides>
+struct UnitCircleTable {
+    GLfloat vertices[2*(Sides + 2)];
+    GLushort indices[3*Sides];
 
-  for ( int i = 1; i < numberOfVertices; i++ )
-  {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
+    constexpr UnitCircleTable () : vertices(), indices()
+    {
+      const GLfloat twicePi = 2.0f * M_PI;
+      for (int i = 1; i < Sides + 2; i++) {
+        GLfloat angle = i * twicePi / Sides;
+        vertices[2*i] = tableCos(tableAngle(angle));
+        vertices[2*i + 1] = tableSin(tableAngle(angle));
+      }
+      for (int i = 1; i <= Sides; i++) {
+        indices[3*(i - 1) + 1] = i;
+        indices[3*(i - 1) + 2] = i < Sides ? i + 1 : 1;
+      }
+    }
+};
+
+static constexpr UnitCircleTable<8> unitCircle8;
+static constexpr UnitCircleTable<16> unitCircle16;
+static constexpr UnitCircleTable<32> unitCircle32;
+static constexpr UnitCircleTable<64> unitCircle64;
+static constexpr UnitCircleTable<128> unitCircle128;
+static constexpr UnitCircleTable<360> unitCircle360;
+
+// Quad k is vertices 4k to 4k+3 in order around it, split along the 4k+2 to 4k diagonal
+template <int Quads>
+struct QuadIndexTable {
+    GLushort indices[6*Quads];
+
+    constexpr QuadIndexTable () : indices()
+    {
+      for (int k = 0; k < Quads; k++) {
+        indices[6*k] = 4*k;
+        indices[6*k + 1] = 4*k + 1;
+        indices[6*k + 2] = 4*k + 2;
+        indices[6*k + 3] = 4*k + 2;
+        indices[6*k + 4] = 4*k + 3;
+        indices[6*k + 5] = 4*k;
+      }
+    }
+};
+
+static constexpr QuadIndexTable<QUAD_INDEX_QUADS> quadIndices;
+
+static constexpr GLfloat unitQuad [] = {
+  -1,  1,   1,  1,   1, -1,  -1, -1
+};
+
+static constexpr GLfloat circleQuad [] = {
+  -CIRCLE_QUAD_EXTENT, -CIRCLE_QUAD_EXTENT,
+   CIRCLE_QUAD_EXTENT, -CIRCLE_QUAD_EXTENT,
+   CIRCLE_QUAD_EXTENT,  CIRCLE_QUAD_EXTENT,
+  -CIRCLE_QUAD_EXTENT,  CIRCLE_QUAD_EXTENT
+};
+
+/* The unit fan of a circle with sides sides: the baked table of a standard
+   tessellation, any other one worked out into generated */
+const GLfloat* unitCircleVertices (int sides, vector<GLfloat>& generated)
+{
+  switch (sides) {
+    case 8:   return unitCircle8.vertices;
+    case 16:  return unitCircle16.vertices;
+    case 32:  return unitCircle32.vertices;
+    case 64:  return unitCircle64.vertices;
+    case 128: return unitCircle128.vertices;
+    case 360: return unitCircle360.vertices;
   }
 
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
+  GLfloat twicePi = 2.0f * M_PI;
 
-  for ( int i = 0; i < numberOfVertices; i++ )
+  generated.assign(2*(sides + 2), 0);
+  for ( int i = 1; i < sides + 2; i++ )
   {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
+    generated[i * 2] = cos( i *  twicePi / sides );
+    generated[( i * 2 ) + 1] = sin( i * twicePi / sides );
   }
-
-    // glEnableClientState( GL_VERTEX_ARRAY );
-    //     glVertexPointer( 3, GL_FLOAT, 0, allCircleVertices );
-    //     glDrawArrays( GL_TRIANGLE_FAN, 0, numberOfVertices);
-    // glDisableClientState( GL_VERTEX_ARRAY );
-  circle1 = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
-  
-  circle1->obs = obs;
-  circle1->radius = radius;
-  circle1->x_centre = x;
-  circle1->y_centre = y;
-  if(obs)
-    Obstacles[add++] = circle1;
-    Obstacles[add-1]->scorable = scorable;
+  return &generated[0];
 }
 
-
-void drawCircle2( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
+/* The triangles of the indexed circle with sides sides, the same way */
+const GLushort* unitCircleIndices (int sides, vector<GLushort>& generated)
 {
-  int numberOfVertices = numberOfSides + 2;
+  switch (sides) {
+    case 8:   return unitCircle8.indices;
+    case 16:  return unitCircle16.indices;
+    case 32:  return unitCircle32.indices;
+    case 64:  return unitCircle64.indices;
+    case 128: return unitCircle128.indices;
+    case 360: return unitCircle360.indices;
+  }
 
-  GLfloat twicePi = 2.0f * M_PI;
+  generated.assign(3*sides, 0);
+  for (int i = 1; i <= sides; i++) {
+    generated[3*(i - 1) + 1] = i;
+    generated[3*(i - 1) + 2] = i < sides ? i + 1 : 1;
+  }
+  return &generated[0];
+}
 
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
+/* The index buffer every quad is drawn with, uploaded on first use */
+GLuint sharedQuadIndexBuffer ()
+{
+  static GLuint quadIndexBuffer;
+  if (!quadIndexBuffer)
+  {
+    glGenBuffers (1, &quadIndexBuffer);
+    // Through the copy target, an element array binding would land in whatever VAO is bound
+    stateBindBuffer (GL_COPY_WRITE_BUFFER, quadIndexBuffer);
+    glBufferData (GL_COPY_WRITE_BUFFER, sizeof(quadIndices.indices), quadIndices.indices, GL_STATIC_DRAW);
+  }
+  return quadIndexBuffer;
+}
 
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
+/* The unit mesh of a shape if it has been built, or NULL. Only looks, so the
+   simulation thread may call it once the meshes are built at startup */
+Mesh* findMesh (MeshShape shape, int sides = 0)
+{
+  for (size_t i = 0; i < meshCache.size(); i++)
+    if (meshCache[i].Shape == shape && meshCache[i].Sides == sides)
+      return &meshCache[i];
+  return NULL;
+}
 
-  for ( int i = 1; i < numberOfVertices; i++ )
+/* The unit mesh of a shape, built on first use - needs the GL context */
+Mesh* sharedMesh (MeshShape shape, int sides = 0)
+{
+  Mesh* found = findMesh(shape, sides);
+  if (found)
+    return found;
+
+  Mesh mesh = { shape, sides, 0, 0, 0, GL_TRIANGLES, 4, 6 };
+  const GLfloat* vertices = shape == MESH_QUAD ? unitQuad : circleQuad;
+  const GLushort* indices = NULL;
+  vector<GLfloat> generatedVertices;
+  vector<GLushort> generatedIndices;
+  if (shape == MESH_CIRCLE)
   {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
+    mesh.NumVertices = sides + 1;
+    mesh.NumIndices = 3*sides;
+    vertices = unitCircleVertices(sides, generatedVertices);
+    indices = unitCircleIndices(sides, generatedIndices);
   }
 
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
+  glGenVertexArrays(1, &mesh.VertexArrayID);
+  glGenBuffers (1, &mesh.VertexBuffer);
 
-  for ( int i = 0; i < numberOfVertices; i++ )
+  stateBindVertexArray (mesh.VertexArrayID);
+  stateBindBuffer (GL_ARRAY_BUFFER, mesh.VertexBuffer);
+  glBufferData (GL_ARRAY_BUFFER, 2*mesh.NumVertices*sizeof(GLfloat), vertices, GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);  // attribute 0. Vertices (x,y), unit size
+  stateEnableVertexAttribArray(0);
+  if (shape == MESH_CIRCLE_QUAD)
   {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);  // attribute 2. Same, kept unscaled for the fragment shader
+    stateEnableVertexAttribArray(2);
   }
 
-  circle2 = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
-  
-  circle2->obs = obs;
-  circle2->radius = radius;
-  circle2->x_centre = x;
-  circle2->y_centre = y;
-  if(obs)
-    Obstacles[add++] = circle2;
-    Obstacles[add-1]->scorable = scorable;
+  // The element array binding is part of the VAO
+  if (indices)
+  {
+    glGenBuffers (1, &mesh.IndexBuffer);
+    stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, mesh.IndexBuffer);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, mesh.NumIndices*sizeof(GLushort), indices, GL_STATIC_DRAW);
+  }
+  else
+  {
+    mesh.IndexBuffer = sharedQuadIndexBuffer();
+    stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, mesh.IndexBuffer);
+  }
+
+  meshCache.push_back(mesh);
+  return &meshCache.back();
+}
+
+/* An object drawn with a shared mesh, centred on (x, y) and scaled by (scaleX, scaleY) */
+VAO* createMeshObject (Mesh* mesh, GLfloat x, GLfloat y, GLfloat scaleX, GLfloat scaleY, GLfloat red, GLfloat green, GLfloat blue)
+{
+  struct VAO* vao = allocate3DObject(mesh->PrimitiveMode, mesh->NumVertices, GL_FILL, red, green, blue);
+  vao->VertexArrayID = mesh->VertexArrayID;
+  vao->VertexBuffer = mesh->VertexBuffer;
+  vao->IndexBuffer = mesh->IndexBuffer;
+  vao->NumIndices = mesh->NumIndices;
+  vao->Compact = true;
+  vao->Shared = true;
+  vao->PositionOffset[0] = x;
+  vao->PositionOffset[1] = y;
+  vao->PositionScale[0] = scaleX;
+  vao->PositionScale[1] = scaleY;
+  return vao;
 }
 
+/* Circle levels of detail */
+/* A fan circle is drawn with the fewest sides that keep its rim within
+   CIRCLE_LOD_ERROR pixels of the true circle at its size on screen: the chords
+   of an n-sided fan r pixels across fall r*(1 - cos(pi/n)) short. The levels
+   are built with the full fan, and one is picked for every frame from the zoom
+   and framebuffer size alone, so it only changes when those do.
+   --no-circle-lod always draws the full fan. */
+#define CIRCLE_LOD_ERROR 0.25f
 
-void drawCircle6( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
+static const int circleLodSides[] = { 8, 16, 32, 64, 128 };
+#define CIRCLE_LOD_LEVELS (int) (sizeof(circleLodSides) / sizeof(circleLodSides[0]))
+
+bool circleLods = true;
+
+/* Upload every level below the full fan of sides sides */
+void createCircleLods (int sides)
 {
-  int numberOfVertices = numberOfSides + 2;
+  for (int i = 0; i < CIRCLE_LOD_LEVELS && circleLodSides[i] < sides; i++)
+    sharedMesh(MESH_CIRCLE, circleLodSides[i]);
+}
 
-  GLfloat twicePi = 2.0f * M_PI;
+/* The fan to draw a circle of up to sides sides with, radius pixels on screen.
+   Runs in draw() on the simulation thread, so it only looks up the fans
+   createCircleLods built */
+Mesh* circleLodMesh (int sides, GLfloat radius)
+{
+  // Fewest sides n with r*(1 - cos(pi/n)) <= error, taking 1 - cos(x) as x*x/2
+  GLfloat needed = M_PI * sqrt(radius / (2*CIRCLE_LOD_ERROR));
+  int lodSides = sides;
+  for (int i = 0; i < CIRCLE_LOD_LEVELS && circleLodSides[i] < sides; i++)
+    if (circleLodSides[i] >= needed)
+    {
+      lodSides = circleLodSides[i];
+      break;
+    }
+
+  Mesh* mesh = findMesh(MESH_CIRCLE, lodSides);
+  if (!mesh)
+  {
+    fprintf(stderr, "Circle level of detail: no %d-sided fan, createCircleLods(%d) was not called\n", lodSides, sides);
+    exit(EXIT_FAILURE);
+  }
+  return mesh;
+}
 
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
 
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
+/* Circles */
+/* By default a circle is the shared SDF quad, and the disc is cut out in
+   Circle_GL.frag from its distance to the centre. The quad reaches
+   CIRCLE_QUAD_EXTENT radii out so the antialiased rim fits. --fan-circles draws
+   the shared unit fan instead. */
+bool sdfCircles = true;
+
+VAO* createCircleObject (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides, int r, int g, int b)
+{
+  if (sdfCircles)
+  {
+    struct VAO* vao = createMeshObject(sharedMesh(MESH_CIRCLE_QUAD), x, y, radius, radius, r, g, b);
+    vao->circle = true;
+    vao->Sdf = true;
+    return vao;
+  }
 
-  for ( int i = 1; i < numberOfVertices; i++ )
+  if (compactVertices)
   {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
+    struct VAO* vao = createMeshObject(sharedMesh(MESH_CIRCLE, numberOfSides), x, y, radius, radius, r, g, b);
+    vao->Sides = numberOfSides;
+    createCircleLods(numberOfSides);
+    return vao;
   }
 
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
+  // The split format keeps a fan of its own per circle, the unit fan placed in the world
+  int numberOfVertices = numberOfSides + 2;
+
+  vector<GLfloat> generated;
+  const GLfloat* unitCircle = unitCircleVertices(numberOfSides, generated);
 
+  vector<GLfloat> allCircleVertices(numberOfVertices * 3);
   for ( int i = 0; i < numberOfVertices; i++ )
   {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
+    allCircleVertices[i * 3] = x + ( radius * unitCircle[i * 2] );
+    allCircleVertices[( i * 3 ) + 1] = y + ( radius * unitCircle[( i * 2 ) + 1] );
+    allCircleVertices[( i * 3 ) + 2] = z;
   }
 
-  circle6 = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
+  return create3DObject(GL_TRIANGLE_FAN, numberOfVertices, &allCircleVertices[0],r,g,b);
+}
+
+void drawCannon( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
+{
+  cannon = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
+  
+  cannon->obs = obs;
+  cannon->radius = radius;
+  cannon->x_centre = x;
+  cannon->y_centre = y;
+  cannon->circle = true;
+}
+
+
+void drawCircle1( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
+{
+  circle1 = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
+  
+  circle1->obs = obs;
+  circle1->radius = radius;
+  circle1->x_centre = x;
+  circle1->y_centre = y;
+  circle1->circle = true;
+  if(obs)
+    Obstacles[add++] = circle1;
+    Obstacles[add-1]->scorable = scorable;
+}
+
+
+void drawCircle2( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
+{
+  circle2 = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
+  
+  circle2->obs = obs;
+  circle2->radius = radius;
+  circle2->x_centre = x;
+  circle2->y_centre = y;
+  circle2->circle = true;
+  if(obs)
+    Obstacles[add++] = circle2;
+    Obstacles[add-1]->scorable = scorable;
+}
+
+
+void drawCircle6( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
+{
+  circle6 = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
   
   circle6->obs = obs;
   circle6->radius = radius;
   circle6->x_centre = x;
   circle6->y_centre = y;
+  circle6->circle = true;
   if(obs)
     Obstacles[add++] = circle6;
     Obstacles[add-1]->scorable = scorable;
@@ -528,40 +1515,13 @@ void drawCircle6( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberO
 
 void drawCircle7( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
 {
-  int numberOfVertices = numberOfSides + 2;
-
-  GLfloat twicePi = 2.0f * M_PI;
-
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
-
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
-
-  for ( int i = 1; i < numberOfVertices; i++ )
-  {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
-  }
-
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
-
-  for ( int i = 0; i < numberOfVertices; i++ )
-  {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
-  }
-
-  circle7 = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
+  circle7 = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
   
   circle7->obs = obs;
   circle7->radius = radius;
   circle7->x_centre = x;
   circle7->y_centre = y;
+  circle7->circle = true;
   if(obs)
     Obstacles[add++] = circle7;
     Obstacles[add-1]->scorable = scorable;
@@ -569,40 +1529,13 @@ void drawCircle7( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberO
 
 void drawCircle8( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
 {
-  int numberOfVertices = numberOfSides + 2;
-
-  GLfloat twicePi = 2.0f * M_PI;
-
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
-
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
-
-  for ( int i = 1; i < numberOfVertices; i++ )
-  {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
-  }
-
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
-
-  for ( int i = 0; i < numberOfVertices; i++ )
-  {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
-  }
-
-  circle8 = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
+  circle8 = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
   
   circle8->obs = obs;
   circle8->radius = radius;
   circle8->x_centre = x;
   circle8->y_centre = y;
+  circle8->circle = true;
   if(obs)
     Obstacles[add++] = circle8;
     Obstacles[add-1]->scorable = scorable;
@@ -611,40 +1544,13 @@ void drawCircle8( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberO
 
 void drawCircle4( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
 {
-  int numberOfVertices = numberOfSides + 2;
-
-  GLfloat twicePi = 2.0f * M_PI;
-
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
-
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
-
-  for ( int i = 1; i < numberOfVertices; i++ )
-  {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
-  }
-
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
-
-  for ( int i = 0; i < numberOfVertices; i++ )
-  {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
-  }
-
-  circle4 = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
+  circle4 = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
   
   circle4->obs = obs;
   circle4->radius = radius;
   circle4->x_centre = x;
   circle4->y_centre = y;
+  circle4->circle = true;
   if(obs)
     Obstacles[add++] = circle4;
     Obstacles[add-1]->scorable = scorable;
@@ -653,40 +1559,13 @@ void drawCircle4( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberO
 
 void drawCircle5( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
 {
-  int numberOfVertices = numberOfSides + 2;
-
-  GLfloat twicePi = 2.0f * M_PI;
-
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
-
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
-
-  for ( int i = 1; i < numberOfVertices; i++ )
-  {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
-  }
-
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
-
-  for ( int i = 0; i < numberOfVertices; i++ )
-  {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
-  }
-
-  circle5 = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
+  circle5 = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
   
   circle5->obs = obs;
   circle5->radius = radius;
   circle5->x_centre = x;
   circle5->y_centre = y;
+  circle5->circle = true;
   if(obs)
     Obstacles[add++] = circle2;
     Obstacles[add-1]->scorable = scorable;
@@ -695,40 +1574,13 @@ void drawCircle5( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberO
 
 void drawCircle3( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberOfSides,bool obs , bool scorable,int r,int g,int b)
 {
-  int numberOfVertices = numberOfSides + 2;
-
-  GLfloat twicePi = 2.0f * M_PI;
-
-  GLfloat circleVerticesX[numberOfVertices];
-  GLfloat circleVerticesY[numberOfVertices];
-  GLfloat circleVerticesZ[numberOfVertices];
-
-  circleVerticesX[0] = x;
-  circleVerticesY[0] = y;
-  circleVerticesZ[0] = z;
-
-  for ( int i = 1; i < numberOfVertices; i++ )
-  {
-    circleVerticesX[i] = x + ( radius * cos( i *  twicePi / numberOfSides ) );
-    circleVerticesY[i] = y + ( radius * sin( i * twicePi / numberOfSides ) );
-    circleVerticesZ[i] = z;
-  }
-
-  GLfloat allCircleVertices[( numberOfVertices ) * 3];
-
-  for ( int i = 0; i < numberOfVertices; i++ )
-  {
-    allCircleVertices[i * 3] = circleVerticesX[i];
-    allCircleVertices[( i * 3 ) + 1] = circleVerticesY[i];
-    allCircleVertices[( i * 3 ) + 2] = circleVerticesZ[i];
-  }
-
-  circle3 = create3DObject(GL_TRIANGLE_FAN, numberOfVertices, allCircleVertices,r,g,b);
+  circle3 = createCircleObject(x, y, z, radius, numberOfSides, r, g, b);
   
   circle3->obs = obs;
   circle3->radius = radius;
   circle3->x_centre = x;
   circle3->y_centre = y;
+  circle3->circle = true;
   if(obs)
     Obstacles[add++] = circle3;
     Obstacles[add-1]->scorable = scorable;
@@ -736,33 +1588,36 @@ void drawCircle3( GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLint numberO
 
 
 
-//Creates the rectangle object used in this sample code
-void createRectangle (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, bool obs, GLfloat angle)
+/* Rectangles */
+/* A rectangle is the shared unit quad, radius*cos(angle) wide and radius*sin(angle)
+   high on each side of (x, y). The split format keeps its own six vertices. */
+VAO* createRectangleObject (GLfloat x, GLfloat y, GLfloat radius, GLfloat angle, GLfloat red, GLfloat green, GLfloat blue)
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-    x + radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 2
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-    x - radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 4
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
+  GLfloat halfWidth = radius*cos(angle*(M_PI/180));
+  GLfloat halfHeight = radius*sin(angle*(M_PI/180));
 
-  };
-
-  static const GLfloat color_buffer_data [] = {
-    1,0,0, // color 1
-    1,0,0, // color 2
-    1,0,0, // color 3
+  if (compactVertices)
+    return createMeshObject(sharedMesh(MESH_QUAD), x, y, halfWidth, halfHeight, red, green, blue);
 
-    1,0,0, // color 3
-    1,0,0, // color 4
-    1,0,0  // color 1
+  // GL3 accepts only Triangles. Quads are not supported
+  const GLfloat vertex_buffer_data [] = {
+    x - halfWidth,y + halfHeight,0, // vertex 1
+    x + halfWidth,y + halfHeight,0, // vertex 2
+    x + halfWidth,y - halfHeight,0, // vertex 3
+
+    x + halfWidth,y - halfHeight,0, // vertex 3
+    x - halfWidth,y - halfHeight,0, // vertex 4
+    x - halfWidth,y + halfHeight,0, // vertex 1
   };
 
   // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  return create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, red, green, blue);
+}
+
+//Creates the rectangle object used in this sample code
+void createRectangle (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, bool obs, GLfloat angle)
+{
+  rectangle = createRectangleObject(x, y, radius, angle, 1,0,0);
   rectangle->obs = obs;
   rectangle->x_centre = x;
   rectangle->y_centre = y;
@@ -774,178 +1629,1676 @@ void createRectangle (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, bool obs,
 
 void createRectangle1 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-    x + radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 2
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-    x - radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 4
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-
-  };
-
-
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle1 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 0.5,0.2,0.5);
+  rectangle1 = createRectangleObject(x, y, radius, angle, 0.5,0.2,0.5);
 }
 
-
-
 void createRectangle2 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-    x + radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 2
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-    x - radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 4
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-
-  };
+  rectangle2 = createRectangleObject(x, y, radius, angle, 1,0.84,0);
+}
 
-  static const GLfloat color_buffer_data [] = {
-    1,0.84,0, // color 1
-    1,0.84,0, // color 2
-    1,0.84,0, // color 3
+void createRectangle3 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+{
+  rectangle3 = createRectangleObject(x, y, radius, angle, 1,0.84,0);
+}
 
-    1,0.84,0, // color 3
-    1,0.84,0, // color 4
-    1,0.84,0,  // color 1
-  };
+void createRectangle4 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+{
+  rectangle4 = createRectangleObject(x, y, radius, angle, 1,0.84,0);
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle2 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+void createRectangle5 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+{
+  rectangle5 = createRectangleObject(x, y, radius, angle, 1,0.84,0);
 }
 
+void createRectangle6 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+{
+  rectangle6 = createRectangleObject(x, y, radius, angle, 1,1,1);
+}
 
-void createRectangle3 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+void createRectangle7 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-    x + radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 2
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
+  rectangle7 = createRectangleObject(x, y, radius, angle, 1,0,0);
+  rectangle7->x_centre = x;
+  rectangle7->y_centre = y;
+  rectangle7->radius = radius;
+}
 
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-    x - radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 4
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
+// void createBar()
 
-  };
+/* Instanced rendering of the circular obstacles */
+/* One shared unit circle, one instance per circle in Obstacles[] */
+struct ObstacleInstance {
+    GLfloat x_centre;
+    GLfloat y_centre;
+    GLfloat radius;
+    GLfloat alive;
+    GLfloat red;
+    GLfloat green;
+    GLfloat blue;
+};
 
-  static const GLfloat color_buffer_data [] = {
-    1,0.84,0, // color 1
-    1,0.84,0, // color 2
-    1,0.84,0, // color 3
+struct ObstacleBatch {
+    GLuint VertexArrayID;
+    GLuint VertexBuffer;    // unit circle from the mesh cache, shared by all instances
+    GLuint IndexBuffer;     // and its triangles
+    GLuint InstanceBuffer;  // one ObstacleInstance per circular obstacle
+
+    int NumIndices;
+    int Sides;              // of the full unit circle, 0 for SDF circles
+    int NumInstances;
+    int NumVisible;         // instances not culled, at the front of Instances
+    VAO* Members[100];
+    ObstacleInstance Instances[100];
+    bool dirty;
+} obstacleBatch;
+
+// How the obstacles are drawn - one call each, circles instanced, or all in one multi-draw
+enum ObstacleMode {
+    OBSTACLES_SEPARATE,
+    OBSTACLES_INSTANCED,
+    OBSTACLES_MULTIDRAW
+};
 
-    1,0.84,0, // color 3
-    1,0.84,0, // color 4
-    1,0.84,0,  // color 1
-  };
+ObstacleMode obstacleMode = OBSTACLES_INSTANCED;
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle3 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+void createObstacleBatch (GLint numberOfSides)
+{
+  // The unit circle of every instance, or the corners of their quad for SDF circles
+  Mesh* mesh = sdfCircles ? sharedMesh(MESH_CIRCLE_QUAD) : sharedMesh(MESH_CIRCLE, numberOfSides);
+
+  obstacleBatch.NumIndices = mesh->NumIndices;
+  obstacleBatch.Sides = sdfCircles ? 0 : numberOfSides;
+  if (!sdfCircles)
+    createCircleLods(numberOfSides);
+  obstacleBatch.NumInstances = 0;
+  for (int k = 0; k < add; k++)
+  {
+    if (!Obstacles[k]->circle)
+      continue;
+    obstacleBatch.Members[obstacleBatch.NumInstances++] = Obstacles[k];
+  }
+
+  obstacleBatch.VertexBuffer = mesh->VertexBuffer;
+  obstacleBatch.IndexBuffer = mesh->IndexBuffer;
+  glGenVertexArrays(1, &(obstacleBatch.VertexArrayID));
+  glGenBuffers (1, &(obstacleBatch.InstanceBuffer));
+
+  stateBindVertexArray (obstacleBatch.VertexArrayID);
+  stateBindBuffer (GL_ARRAY_BUFFER, obstacleBatch.VertexBuffer);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);  // attribute 0. Unit circle vertices (x,y)
+  stateEnableVertexAttribArray(0);
+  stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, obstacleBatch.IndexBuffer);
+
+  stateBindBuffer (GL_ARRAY_BUFFER, obstacleBatch.InstanceBuffer);
+  glBufferData (GL_ARRAY_BUFFER, sizeof(obstacleBatch.Instances), NULL, GL_DYNAMIC_DRAW);
+  glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(ObstacleInstance), (void*)0);  // attribute 2. Centre, radius, alive
+  glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(ObstacleInstance), (void*)(4*sizeof(GLfloat)));  // attribute 3. Colour
+  glVertexAttribDivisor(2, 1);
+  glVertexAttribDivisor(3, 1);
+  stateEnableVertexAttribArray(2);
+  stateEnableVertexAttribArray(3);
+
+  obstacleBatch.dirty = true;
 }
 
-void createRectangle4 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+/* Refresh the instance data of the batch, only when an obstacle was hit or the view changed */
+void updateObstacleBatch ()
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-    x + radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 2
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
+  if (!obstacleBatch.dirty)
+    return;
 
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-    x - radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 4
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
+  obstacleBatch.NumVisible = 0;
+  for (int i = 0; i < obstacleBatch.NumInstances; i++)
+  {
+    VAO* obstacle = obstacleBatch.Members[i];
+    if (obstacle->DrawnCulled)
+      continue;
+    ObstacleInstance* instance = &obstacleBatch.Instances[obstacleBatch.NumVisible++];
+    instance->x_centre = obstacle->x_centre;
+    instance->y_centre = obstacle->y_centre;
+    instance->radius = obstacle->radius;
+    instance->alive = obstacle->DrawnAlive ? 1 : 0;
+    instance->red = obstacle->red;
+    instance->green = obstacle->green;
+    instance->blue = obstacle->blue;
+  }
 
-  };
+  stateBindBuffer (GL_ARRAY_BUFFER, obstacleBatch.InstanceBuffer);
+  glBufferSubData (GL_ARRAY_BUFFER, 0, obstacleBatch.NumVisible*sizeof(ObstacleInstance), obstacleBatch.Instances);
+  obstacleBatch.dirty = false;
+}
 
-  static const GLfloat color_buffer_data [] = {
-    1,0.84,0, // color 1
-    1,0.84,0, // color 2
-    1,0.84,0, // color 3
+/* Draw every circular obstacle with a single instanced call */
+void drawObstacleBatch (Mesh* lod)
+{
+  updateObstacleBatch();
+  if (obstacleBatch.NumVisible == 0)
+    return;
 
-    1,0.84,0, // color 3
-    1,0.84,0, // color 4
-    1,0.84,0,  // color 1
-  };
+  if (lod && lod->VertexBuffer != obstacleBatch.VertexBuffer)
+  {
+    // Switch the unit circle to the level of detail picked for this frame
+    stateBindVertexArray (obstacleBatch.VertexArrayID);
+    stateBindBuffer (GL_ARRAY_BUFFER, lod->VertexBuffer);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, lod->IndexBuffer);
+    obstacleBatch.VertexBuffer = lod->VertexBuffer;
+    obstacleBatch.IndexBuffer = lod->IndexBuffer;
+    obstacleBatch.NumIndices = lod->NumIndices;
+  }
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle4 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+  stateUseProgram (instancedProgramID);
+  stateBlend (sdfCircles);
+
+  statePolygonMode (GL_FILL);
+  stateBindVertexArray (obstacleBatch.VertexArrayID);
+  stateDrawElementsInstanced(GL_TRIANGLES, obstacleBatch.NumIndices, GL_UNSIGNED_SHORT, (void*)0, obstacleBatch.NumVisible);
+
+  stateUseProgram (programID);
 }
 
-void createRectangle5 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+/* Multi-draw obstacle batch */
+/* Every obstacle, whatever its shape, is copied into one shared VBO as an indexed
+   triangle list, indexed meshes as they are and fans split into their triangles,
+   and the live ones are drawn by a single glMultiDrawElements call. Each obstacle
+   is one range of the index buffer; neighbours that are both live are drawn as
+   one range. The ranges are rebuilt only when an obstacle is hit. */
+struct BatchVertex {
+    GLfloat x, y;
+    GLubyte red, green, blue, alpha;
+    GLfloat u, v;   // position in radii for SDF circles, 0 for everything else
+};
+
+struct MultiDrawBatch {
+    GLuint VertexArrayID;
+    GLuint VertexBuffer;   // pos2 + rgba8, every obstacle back to back
+    GLuint IndexBuffer;    // GLuint triangles, every obstacle back to back
+
+    int NumMembers;
+    VAO* Members[100];
+    int IndexBegin[101];   // indices of member i are [IndexBegin[i], IndexBegin[i+1])
+
+    vector<const GLvoid*> First;   // ranges of the live members only, as byte offsets
+    vector<GLsizei> Count;
+    bool dirty;
+} multiDrawBatch;
+
+/* Read the 2D positions of an object back from its VBO, as stored (before PositionOffset/Scale) */
+void readObjectPositions (VAO* vao, vector<GLfloat>& positions)
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-    x + radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 2
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
+  int n = vao->NumVertices;
+  positions.resize(2*n);
+
+  stateBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+  if (!vao->Compact) {
+    vector<GLfloat> xyz(3*n);
+    glGetBufferSubData (GL_ARRAY_BUFFER, 0, xyz.size()*sizeof(GLfloat), &xyz[0]);
+    for (int i = 0; i < n; i++) {
+      positions[2*i] = xyz[3*i];
+      positions[2*i + 1] = xyz[3*i + 1];
+    }
+  }
+  else if (quantizeVertices && !vao->Shared) {
+    vector<GLshort> packed(2*n);
+    glGetBufferSubData (GL_ARRAY_BUFFER, 0, packed.size()*sizeof(GLshort), &packed[0]);
+    for (int i = 0; i < 2*n; i++)
+      positions[i] = packed[i] / 32767.0f;
+  }
+  else
+    glGetBufferSubData (GL_ARRAY_BUFFER, 0, positions.size()*sizeof(GLfloat), &positions[0]);
+}
 
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-    x - radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 4
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
+/* The triangles of an object, read back from its index buffer or, for the
+   vertices drawn in order, as the triangle list or fan they make */
+void readObjectIndices (VAO* vao, vector<GLuint>& indices)
+{
+  indices.clear();
+  if (vao->NumIndices) {
+    vector<GLushort> stored(vao->NumIndices);
+    // Through the copy target, an element array binding would land in whatever VAO is bound
+    stateBindBuffer (GL_COPY_READ_BUFFER, vao->IndexBuffer);
+    glGetBufferSubData (GL_COPY_READ_BUFFER, 0, stored.size()*sizeof(GLushort), &stored[0]);
+    indices.assign(stored.begin(), stored.end());
+  }
+  else if (vao->PrimitiveMode == GL_TRIANGLES) {
+    for (int i = 0; i + 2 < vao->NumVertices; i += 3) {
+      indices.push_back(i);
+      indices.push_back(i + 1);
+      indices.push_back(i + 2);
+    }
+  }
+  else {
+    for (int i = 1; i + 1 < vao->NumVertices; i++) {
+      indices.push_back(0);
+      indices.push_back(i);
+      indices.push_back(i + 1);
+    }
+  }
+}
 
-  };
+GLubyte unitToByte (GLfloat value)
+{
+  return (GLubyte) lround(min(max(value, 0.0f), 1.0f) * 255);
+}
 
-  static const GLfloat color_buffer_data [] = {
-    1,0.84,0, // color 1
-    1,0.84,0, // color 2
-    1,0.84,0, // color 3
+void createMultiDrawBatch ()
+{
+  vector<BatchVertex> vertices;
+  vector<GLuint> indices;
+  vector<GLfloat> positions;
+  vector<GLuint> objectIndices;
 
-    1,0.84,0, // color 3
-    1,0.84,0, // color 4
-    1,0.84,0,  // color 1
-  };
+  multiDrawBatch.NumMembers = 0;
+  for (int k = 0; k < add; k++)
+  {
+    VAO* obstacle = Obstacles[k];
+    int member = multiDrawBatch.NumMembers++;
+    multiDrawBatch.Members[member] = obstacle;
+    multiDrawBatch.IndexBegin[member] = indices.size();
+
+    GLuint base = vertices.size();
+    readObjectPositions(obstacle, positions);
+    for (int i = 0; i < obstacle->NumVertices; i++)
+    {
+      BatchVertex vertex = { obstacle->PositionOffset[0] + positions[2*i] * obstacle->PositionScale[0],
+                             obstacle->PositionOffset[1] + positions[2*i + 1] * obstacle->PositionScale[1],
+                             unitToByte(obstacle->red), unitToByte(obstacle->green), unitToByte(obstacle->blue), 255,
+                             obstacle->Sdf ? positions[2*i] : 0, obstacle->Sdf ? positions[2*i + 1] : 0 };
+      vertices.push_back(vertex);
+    }
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle5 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+    readObjectIndices(obstacle, objectIndices);
+    for (size_t i = 0; i < objectIndices.size(); i++)
+      indices.push_back(base + objectIndices[i]);
+  }
+  multiDrawBatch.IndexBegin[multiDrawBatch.NumMembers] = indices.size();
+
+  glGenVertexArrays(1, &(multiDrawBatch.VertexArrayID));
+  glGenBuffers (1, &(multiDrawBatch.VertexBuffer));
+
+  stateBindVertexArray (multiDrawBatch.VertexArrayID);
+  stateBindBuffer (GL_ARRAY_BUFFER, multiDrawBatch.VertexBuffer);
+  glBufferData (GL_ARRAY_BUFFER, vertices.size()*sizeof(BatchVertex), vertices.empty() ? NULL : &vertices[0], GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), (void*)0);  // attribute 0. Vertices (x,y)
+  glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BatchVertex), (void*)(2*sizeof(GLfloat)));  // attribute 1. Colour
+  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), (void*)(2*sizeof(GLfloat) + 4));  // attribute 2. Circle coordinates
+  stateEnableVertexAttribArray(0);
+  stateEnableVertexAttribArray(1);
+  stateEnableVertexAttribArray(2);
+
+  glGenBuffers (1, &(multiDrawBatch.IndexBuffer));
+  stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, multiDrawBatch.IndexBuffer);
+  glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices.size()*sizeof(GLuint), indices.empty() ? NULL : &indices[0], GL_STATIC_DRAW);
+
+  multiDrawBatch.dirty = true;
 }
 
+/* Collect the ranges of the visible obstacles still alive, only when one was hit or the view changed */
+void updateMultiDrawBatch ()
+{
+  if (!multiDrawBatch.dirty)
+    return;
 
-void createRectangle6 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+  multiDrawBatch.First.clear();
+  multiDrawBatch.Count.clear();
+  bool previousLive = false;
+  for (int i = 0; i < multiDrawBatch.NumMembers; i++)
+  {
+    bool live = multiDrawBatch.Members[i]->DrawnAlive && !multiDrawBatch.Members[i]->DrawnCulled;
+    GLsizei count = multiDrawBatch.IndexBegin[i + 1] - multiDrawBatch.IndexBegin[i];
+    if (live && previousLive)
+      multiDrawBatch.Count.back() += count;  // follows on from the last range
+    else if (live) {
+      multiDrawBatch.First.push_back((const GLvoid*) (multiDrawBatch.IndexBegin[i] * sizeof(GLuint)));
+      multiDrawBatch.Count.push_back(count);
+    }
+    previousLive = live;
+  }
+  multiDrawBatch.dirty = false;
+}
+
+/* Draw every live obstacle with a single multi-draw call */
+void drawMultiDrawBatch ()
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-    x + radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 2
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
+  updateMultiDrawBatch();
+  if (multiDrawBatch.First.empty())
+    return;
 
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-    x - radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 4
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
+  // Polygons sit at the centre of the circle coordinates, fully inside
+  stateUseProgram (sdfCircles ? circleProgramID : programID);
+  stateBlend (sdfCircles);
 
-  };
+  statePolygonMode (GL_FILL);
+  stateBindVertexArray (multiDrawBatch.VertexArrayID);
+  stateMultiDrawElements(GL_TRIANGLES, &multiDrawBatch.Count[0], GL_UNSIGNED_INT, &multiDrawBatch.First[0], multiDrawBatch.First.size());
+}
 
+/* Whether an obstacle is drawn by one of the batches instead of on its own */
+bool batchedObstacle (VAO* obstacle)
+{
+  return obstacleMode == OBSTACLES_MULTIDRAW || (obstacleMode == OBSTACLES_INSTANCED && obstacle->circle);
+}
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle6 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 1,1,1);
+/* View culling */
+/* The ortho rectangle only changes with zoom or resize, so the Culled flags are
+   recomputed when the projection differs from the one they were computed for
+   rather than every frame. Each batch then rebuilds its draw list once. */
+struct ViewCulling {
+    glm::mat4 projection;
+    bool valid;
+    int culled;
+} viewCulling;
+
+bool viewCullingEnabled = true;
+
+void cullObstacles (glm::mat4 VP)
+{
+  if (viewCulling.valid && viewCulling.projection == Matrices.projection)
+    return;
+  viewCulling.projection = Matrices.projection;
+  viewCulling.valid = true;
+
+  // Corners of the view in world space, obstacles lie in the z = 0 plane
+  glm::mat4 inverseVP = glm::inverse(VP);
+  glm::vec4 low = inverseVP * glm::vec4(-1, -1, 0, 1);
+  glm::vec4 high = inverseVP * glm::vec4(1, 1, 0, 1);
+  GLfloat left = min(low.x, high.x) / low.w, right = max(low.x, high.x) / low.w;
+  GLfloat bottom = min(low.y, high.y) / low.w, top = max(low.y, high.y) / low.w;
+
+  viewCulling.culled = 0;
+  for (int k = 0; k < add; k++)
+  {
+    VAO* obstacle = Obstacles[k];
+    GLfloat r = obstacle->radius;
+    obstacle->Culled = viewCullingEnabled &&
+      (obstacle->x_centre + r < left || obstacle->x_centre - r > right ||
+       obstacle->y_centre + r < bottom || obstacle->y_centre - r > top);
+    viewCulling.culled += obstacle->Culled;
+  }
 }
 
-void createRectangle7 (GLfloat x, GLfloat y, GLfloat z, GLfloat radius, GLfloat angle)
+/* Cached static layer */
+GLuint compositeProgramID;
+
+void createStaticLayer ()
 {
-  // GL3 accepts only Triangles. Quads are not supported
-  static const GLfloat vertex_buffer_data [] = {
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
-    x + radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 2
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
+  glGenFramebuffers (1, &staticLayer.Framebuffer);
+  glGenTextures (1, &staticLayer.Texture);
+  glGenVertexArrays (1, &staticLayer.VertexArrayID);
+
+  stateBindTexture (staticLayer.Texture);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  staticLayer.width = staticLayer.height = 0;
+  staticLayer.dirty = true;
+}
 
-    x + radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 3
-    x - radius*cos(angle*(M_PI/180)),y - radius*sin(angle*(M_PI/180)),0, // vertex 4
-    x - radius*cos(angle*(M_PI/180)),y + radius*sin(angle*(M_PI/180)),0, // vertex 1
+/* Match the layer to the framebuffer size */
+void resizeStaticLayer (int width, int height)
+{
+  staticLayer.dirty = true;
+  if (width == staticLayer.width && height == staticLayer.height)
+    return;
 
-  };
+  stateBindTexture (staticLayer.Texture);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 
+  stateBindFramebuffer (staticLayer.Framebuffer);
+  glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, staticLayer.Texture, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+  {
+    fprintf(stderr, "Static layer framebuffer incomplete, drawing the static scene every frame\n");
+    staticLayerEnabled = false;
+  }
+  stateBindFramebuffer (sceneFramebuffer);
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  rectangle7 = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, 1,0,0);
+  staticLayer.width = width;
+  staticLayer.height = height;
 }
 
-// void createBar()
+void drawStaticLayer ()
+{
+  stateUseProgram (compositeProgramID);
+  stateBlend (false);
+  stateBindTexture (staticLayer.Texture);
+  statePolygonMode (GL_FILL);
+  stateBindVertexArray (staticLayer.VertexArrayID);
+  stateDrawArrays (GL_TRIANGLES, 0, 3);
+  stateUseProgram (programID);
+}
+
+/* Dynamic resolution */
+/* The scene is drawn into an offscreen target scale times the framebuffer size
+   and stretched onto the framebuffer with a linear blit, then the HUD is drawn
+   on top at full resolution. The GPU time of the scene is measured with
+   GL_TIME_ELAPSED queries that are read a few frames later, so the CPU never
+   waits for them. Over the budget the scale drops a step; it only goes back up
+   once the scene would still fit with margin at the larger size, and after a
+   change the controller waits for fresh measurements, so it does not flip
+   between two sizes. */
+#define RESOLUTION_QUERIES 4
+#define RESOLUTION_STEP 0.125f
+#define RESOLUTION_MIN_SCALE 0.5f
+#define RESOLUTION_SETTLE_FRAMES 30  // measured frames to wait after a change
+#define RESOLUTION_HEADROOM 0.85     // share of the budget a larger scale may be predicted to use
+
+struct DynamicResolution {
+    bool enabled;             // off unless asked for with --dynamic-resolution
+    double targetMs;          // GPU time budget of the scene
+    float scale;
+    GLuint Framebuffer;
+    GLuint Texture;
+    GLuint Queries[RESOLUTION_QUERIES];
+    int next;                 // query issued this frame
+    int pending;              // issued, result not read yet
+    int stale;                // pending results measured at the previous scale
+    bool timing;              // a query is running
+    double averageMs;         // smoothed GPU time of the scene, < 0 until measured
+    int settle;               // measured frames left before the next change
+} dynamicResolution = { false, 12.0, 1.0f };
+
+void createDynamicResolution ()
+{
+  if (!dynamicResolution.enabled)
+  {
+    sceneFramebuffer = screenFramebuffer;
+    return;
+  }
+
+  glGenFramebuffers (1, &dynamicResolution.Framebuffer);
+  glGenTextures (1, &dynamicResolution.Texture);
+  glGenQueries (RESOLUTION_QUERIES, dynamicResolution.Queries);
+
+  stateBindTexture (dynamicResolution.Texture);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  sceneFramebuffer = dynamicResolution.Framebuffer;
+  dynamicResolution.averageMs = -1;
+}
+
+/* Size the scene target for a framebuffer of width x height at the current scale */
+void resizeSceneTarget (int width, int height)
+{
+  sceneWidth = width;
+  sceneHeight = height;
+  partialRedraw.kept = false;
+
+  if (dynamicResolution.enabled)
+  {
+    sceneWidth = max(1, (int) lround(width * dynamicResolution.scale));
+    sceneHeight = max(1, (int) lround(height * dynamicResolution.scale));
+
+    stateBindTexture (dynamicResolution.Texture);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8, sceneWidth, sceneHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    stateBindFramebuffer (dynamicResolution.Framebuffer);
+    glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, dynamicResolution.Texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+      fprintf(stderr, "Dynamic resolution framebuffer incomplete, drawing at full resolution\n");
+      dynamicResolution.enabled = false;
+      sceneFramebuffer = screenFramebuffer;
+      sceneWidth = width;
+      sceneHeight = height;
+    }
+    stateBindFramebuffer (sceneFramebuffer);
+  }
+
+  if (staticLayerEnabled)
+    resizeStaticLayer(sceneWidth, sceneHeight);
+}
+
+void beginSceneTiming ()
+{
+  // Skip the measurement if every query is still waiting for its result, or only the power bar is drawn
+  if (!dynamicResolution.enabled || dynamicResolution.pending == RESOLUTION_QUERIES || partialRedraw.active)
+    return;
+  glBeginQuery (GL_TIME_ELAPSED, dynamicResolution.Queries[dynamicResolution.next]);
+  dynamicResolution.timing = true;
+}
+
+void endSceneTiming ()
+{
+  if (!dynamicResolution.timing)
+    return;
+  glEndQuery (GL_TIME_ELAPSED);
+  dynamicResolution.timing = false;
+  dynamicResolution.next = (dynamicResolution.next + 1) % RESOLUTION_QUERIES;
+  dynamicResolution.pending++;
+}
+
+/* Stretch the scene onto the framebuffer, whatever is drawn next is at full resolution */
+void resolveScene ()
+{
+  if (!dynamicResolution.enabled)
+    return;
+  endSceneTiming();
+  endPartialRedraw();
+
+  bool scaled = sceneWidth != framebufferWidth || sceneHeight != framebufferHeight;
+  stateBindFramebuffer (screenFramebuffer);
+  stateBindReadFramebuffer (dynamicResolution.Framebuffer);
+  glBlitFramebuffer (0, 0, sceneWidth, sceneHeight, 0, 0, framebufferWidth, framebufferHeight,
+                     GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+  stateBindReadFramebuffer (screenFramebuffer);
+  glViewport (0, 0, framebufferWidth, framebufferHeight);
+}
+
+/* Read the finished measurements and pick the scale of the next frames */
+void updateDynamicResolution ()
+{
+  DynamicResolution& dr = dynamicResolution;
+  if (!dr.enabled)
+    return;
+
+  float scale = dr.scale;
+  while (dr.pending > 0)
+  {
+    GLuint query = dr.Queries[(dr.next - dr.pending + RESOLUTION_QUERIES) % RESOLUTION_QUERIES];
+    GLint available = 0;
+    glGetQueryObjectiv (query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      break;
+    GLuint64 elapsed;
+    glGetQueryObjectui64v (query, GL_QUERY_RESULT, &elapsed);
+    dr.pending--;
+    if (dr.stale > 0)
+    {
+      dr.stale--;
+      continue;
+    }
+
+    double ms = elapsed / 1e6;
+    dr.averageMs = dr.averageMs < 0 ? ms : 0.9 * dr.averageMs + 0.1 * ms;
+    if (dr.settle > 0)
+    {
+      dr.settle--;
+      continue;
+    }
+
+    // The scene's cost grows with its pixel count
+    float larger = min(1.0f, dr.scale + RESOLUTION_STEP);
+    double predicted = dr.averageMs * (larger * larger) / (dr.scale * dr.scale);
+    if (dr.averageMs > dr.targetMs)
+      scale = max(RESOLUTION_MIN_SCALE, dr.scale - RESOLUTION_STEP);
+    else if (larger > dr.scale && predicted < RESOLUTION_HEADROOM * dr.targetMs)
+      scale = larger;
+    if (scale != dr.scale)
+      break;
+  }
+
+  if (scale != dr.scale)
+  {
+    dr.scale = scale;
+    dr.averageMs = -1;
+    dr.settle = RESOLUTION_SETTLE_FRAMES;
+    dr.stale = dr.pending;
+    resizeSceneTarget(framebufferWidth, framebufferHeight);
+    markDamage(DAMAGE_VIEW);
+  }
+}
+
+/* Streaming vertex buffer */
+/* Geometry that changes every frame is written into one buffer split into
+   STREAM_REGIONS regions, one per frame in flight. A fence after the frame's
+   draws guards its region, so the CPU only waits if it laps the GPU and the
+   buffer is never reallocated. Vertices are 2D positions, like the packed format. */
+#define STREAM_REGION_SIZE (64*1024)
+#define STREAM_REGIONS 3
+
+struct StreamBuffer {
+    GLuint VertexArrayID;   // attribute 0 reads vec2 positions from the whole buffer
+    GLuint Buffer;
+    GLubyte* Mapped;        // persistent mapping, NULL when each write maps its range
+    int region;
+    GLsizeiptr used;        // bytes written into the current region
+    GLsync Fences[STREAM_REGIONS];
+} streamBuffer;
+
+bool persistentStreaming = true;
+
+void createStreamBuffer ()
+{
+  GLsizeiptr size = STREAM_REGION_SIZE * STREAM_REGIONS;
+
+  glGenVertexArrays (1, &streamBuffer.VertexArrayID);
+  glGenBuffers (1, &streamBuffer.Buffer);
+
+  stateBindVertexArray (streamBuffer.VertexArrayID);
+  stateBindBuffer (GL_ARRAY_BUFFER, streamBuffer.Buffer);
+
+  streamBuffer.Mapped = NULL;
+  if (persistentStreaming && GLAD_GL_ARB_buffer_storage)
+  {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage (GL_ARRAY_BUFFER, size, NULL, flags);
+    streamBuffer.Mapped = (GLubyte*) glMapBufferRange (GL_ARRAY_BUFFER, 0, size, flags);
+  }
+  else
+    glBufferData (GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);  // attribute 0. Vertices (x,y)
+  stateEnableVertexAttribArray(0);
+
+  streamBuffer.region = 0;
+  streamBuffer.used = 0;
+  for (int i = 0; i < STREAM_REGIONS; i++)
+    streamBuffer.Fences[i] = 0;
+}
+
+/* Move to the next region, waiting for the GPU to finish the frame that used it */
+void streamBeginFrame ()
+{
+  streamBuffer.region = (streamBuffer.region + 1) % STREAM_REGIONS;
+  streamBuffer.used = 0;
+
+  GLsync fence = streamBuffer.Fences[streamBuffer.region];
+  if (fence)
+  {
+    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+      ;
+    glDeleteSync(fence);
+    streamBuffer.Fences[streamBuffer.region] = 0;
+  }
+}
+
+/* Fence the region after the draws reading it have been issued */
+void streamEndFrame ()
+{
+  if (streamBuffer.used)
+    streamBuffer.Fences[streamBuffer.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* Copy numVertices vertices of stride bytes into the current region */
+/* Returns the index of the first vertex for glDrawArrays, or -1 when the region is full */
+GLint streamData (const void* vertices, int numVertices, GLsizeiptr stride)
+{
+  // Start on a whole vertex so the first index can be given in strides
+  streamBuffer.used = (streamBuffer.used + stride - 1) / stride * stride;
+
+  GLsizeiptr bytes = numVertices * stride;
+  if (streamBuffer.used + bytes > STREAM_REGION_SIZE)
+    return -1;
+
+  GLintptr offset = streamBuffer.region * STREAM_REGION_SIZE + streamBuffer.used;
+  if (streamBuffer.Mapped)
+    memcpy(streamBuffer.Mapped + offset, vertices, bytes);
+  else
+  {
+    // The fence already guarantees the GPU is done with this range
+    stateBindBuffer (GL_ARRAY_BUFFER, streamBuffer.Buffer);
+    void* range = glMapBufferRange (GL_ARRAY_BUFFER, offset, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (!range)
+      return -1;
+    memcpy(range, vertices, bytes);
+    glUnmapBuffer (GL_ARRAY_BUFFER);
+  }
+
+  streamBuffer.used += bytes;
+  return offset / stride;
+}
+
+/* Stream 2D positions, read by the VAO of the stream buffer */
+GLint streamVertices (const GLfloat* vertices, int numVertices)
+{
+  return streamData(vertices, numVertices, 2 * sizeof(GLfloat));
+}
+
+/* Draw a range of streamed vertices with the primitive, fill mode and colour of vao */
+void drawStreamed3DObject (struct VAO* vao, GLint first, GLsizei count)
+{
+  stateUseProgram (programID);
+  stateBlend (false);
+  statePolygonMode (vao->FillMode);
+  stateBindVertexArray (streamBuffer.VertexArrayID);
+  stateVertexColor (vao->red, vao->green, vao->blue);
+  stateDrawArrays (vao->PrimitiveMode, first, count);
+}
+
+/* Projectile trail - the last TRAIL_LENGTH positions of the cannon ball */
+#define TRAIL_LENGTH 64
+
+GLfloat trailPoints[TRAIL_LENGTH][2];
+int trailHead;   // next slot to write
+int trailCount;
+VAO trail;
+
+void createTrail ()
+{
+  trail.PrimitiveMode = GL_LINE_STRIP;
+  trail.FillMode = GL_FILL;
+  trail.Compact = true;
+  trail.red = 0.3;
+  trail.green = 0.3;
+  trail.blue = 0.3;
+  trailHead = trailCount = 0;
+}
+
+void recordTrail (GLfloat x, GLfloat y)
+{
+  trailPoints[trailHead][0] = x;
+  trailPoints[trailHead][1] = y;
+  trailHead = (trailHead + 1) % TRAIL_LENGTH;
+  if (trailCount < TRAIL_LENGTH)
+    trailCount++;
+}
+
+void clearTrail ()
+{
+  trailHead = trailCount = 0;
+}
+
+/* Impact particles */
+/* A hit throws a burst out of the obstacle, simulated by Particles.h on the same
+   clock as the cannonball: t advances by tspeed every frame and the ball falls
+   with g in translation units, which draw() divides by 5 to get world units.
+   All live particles are drawn with one instanced call on a small quad; the
+   instance data is uploaded as it is stored, one array per attribute. */
+
+ParticlePool particles;
+
+struct ParticleRenderer {
+    GLuint ProgramID;
+    GLuint VertexArrayID;
+    GLuint QuadBuffer;
+    GLuint InstanceBuffer;    // x, y, life and colour arrays, PARTICLE_CAPACITY each
+    ParticleKernel kernel;
+    int burstSize;
+} particleRenderer = { 0, 0, 0, 0, PARTICLES_SCALAR, 512 };
+
+void createParticles ()
+{
+  static const GLfloat quad [] = { -1,-1, 1,-1, 1,1, -1,1 };
+
+  particles.count = 0;
+  particleRenderer.kernel = bestParticleKernel();
+
+  glGenVertexArrays (1, &particleRenderer.VertexArrayID);
+  glGenBuffers (1, &particleRenderer.QuadBuffer);
+  glGenBuffers (1, &particleRenderer.InstanceBuffer);
+
+  stateBindVertexArray (particleRenderer.VertexArrayID);
+  stateBindBuffer (GL_ARRAY_BUFFER, particleRenderer.QuadBuffer);
+  glBufferData (GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);  // attribute 0. Quad corners
+  stateEnableVertexAttribArray(0);
+
+  GLsizeiptr array = PARTICLE_CAPACITY * sizeof(GLfloat);
+  stateBindBuffer (GL_ARRAY_BUFFER, particleRenderer.InstanceBuffer);
+  glBufferData (GL_ARRAY_BUFFER, 4 * array, NULL, GL_STREAM_DRAW);
+  glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (void*)0);  // attribute 1. x
+  glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, (void*)array);  // attribute 2. y
+  glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, 0, (void*)(2 * array));  // attribute 3. Life left
+  glVertexAttribPointer(4, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (void*)(3 * array));  // attribute 4. Colour
+  for (int i = 1; i <= 4; i++)
+  {
+    glVertexAttribDivisor(i, 1);
+    stateEnableVertexAttribArray(i);
+  }
+}
+
+void spawnImpact (VAO* obstacle)
+{
+  uint32_t color = unitToByte(obstacle->red) | unitToByte(obstacle->green) << 8 | unitToByte(obstacle->blue) << 16 | 255u << 24;
+  spawnParticleBurst(particles, obstacle->x_centre, obstacle->y_centre, color, particleRenderer.burstSize,
+                     0.1f, 0.6f, 1.0f, 4.0f);
+}
+
+/* Advance the particles by one frame, tspeed of the cannonball's time */
+void updateParticles (GLfloat dt, GLfloat gravity)
+{
+  if (particles.count == 0)
+    return;
+  stepParticles(particles, dt, gravity, particleRenderer.kernel);
+  markDamage(DAMAGE_PARTICLES);
+}
+
+/* Draw the particles copied into a frame packet */
+void drawParticles (int count, const GLfloat* x, const GLfloat* y, const GLfloat* life, const GLuint* color)
+{
+  if (count == 0)
+    return;
+
+  // Orphan last frame's instances, then one upload per attribute array
+  GLsizeiptr array = PARTICLE_CAPACITY * sizeof(GLfloat), used = count * sizeof(GLfloat);
+  stateBindBuffer (GL_ARRAY_BUFFER, particleRenderer.InstanceBuffer);
+  glBufferData (GL_ARRAY_BUFFER, 4 * array, NULL, GL_STREAM_DRAW);
+  glBufferSubData (GL_ARRAY_BUFFER, 0, used, x);
+  glBufferSubData (GL_ARRAY_BUFFER, array, used, y);
+  glBufferSubData (GL_ARRAY_BUFFER, 2 * array, used, life);
+  glBufferSubData (GL_ARRAY_BUFFER, 3 * array, used, color);
+
+  stateUseProgram (particleRenderer.ProgramID);
+  stateBlend (true);
+  statePolygonMode (GL_FILL);
+  stateBindVertexArray (particleRenderer.VertexArrayID);
+  stateDrawArraysInstanced (GL_TRIANGLE_FAN, 0, 4, count);
+  stateUseProgram (programID);
+}
+
+/* HUD */
+/* Score, angle, power and frame rate drawn as text over the scene. The glyphs
+   come from a 5x7 bitmap font baked into an R8 atlas at startup; every frame the
+   text is turned into quads in pixel coordinates, streamed, and drawn in one call. */
+#define HUD_GLYPH_WIDTH 5
+#define HUD_GLYPH_HEIGHT 7
+#define HUD_CELL_WIDTH (HUD_GLYPH_WIDTH + 1)   // a blank column between atlas cells
+#define HUD_MAX_CHARS 128
+
+static const char hudGlyphs[] = " %-.0123456789:ACEFGLNOPRSW";
+
+// One byte per row, the low 5 bits from left to right
+static const GLubyte hudFont[][HUD_GLYPH_HEIGHT] = {
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00},  // ' '
+    {0x18,0x19,0x02,0x04,0x08,0x13,0x03},  // '%'
+    {0x00,0x00,0x00,0x1F,0x00,0x00,0x00},  // '-'
+    {0x00,0x00,0x00,0x00,0x00,0x0C,0x0C},  // '.'
+    {0x0E,0x11,0x13,0x15,0x19,0x11,0x0E},  // '0'
+    {0x04,0x0C,0x04,0x04,0x04,0x04,0x0E},  // '1'
+    {0x0E,0x11,0x01,0x02,0x04,0x08,0x1F},  // '2'
+    {0x1F,0x02,0x04,0x02,0x01,0x11,0x0E},  // '3'
+    {0x02,0x06,0x0A,0x12,0x1F,0x02,0x02},  // '4'
+    {0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E},  // '5'
+    {0x06,0x08,0x10,0x1E,0x11,0x11,0x0E},  // '6'
+    {0x1F,0x01,0x02,0x04,0x08,0x08,0x08},  // '7'
+    {0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E},  // '8'
+    {0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C},  // '9'
+    {0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00},  // ':'
+    {0x0E,0x11,0x11,0x1F,0x11,0x11,0x11},  // 'A'
+    {0x0E,0x11,0x10,0x10,0x10,0x11,0x0E},  // 'C'
+    {0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F},  // 'E'
+    {0x1F,0x10,0x10,0x1E,0x10,0x10,0x10},  // 'F'
+    {0x0E,0x11,0x10,0x17,0x11,0x11,0x0F},  // 'G'
+    {0x10,0x10,0x10,0x10,0x10,0x10,0x1F},  // 'L'
+    {0x11,0x11,0x19,0x15,0x13,0x11,0x11},  // 'N'
+    {0x0E,0x11,0x11,0x11,0x11,0x11,0x0E},  // 'O'
+    {0x1E,0x11,0x11,0x1E,0x10,0x10,0x10},  // 'P'
+    {0x1E,0x11,0x11,0x1E,0x14,0x12,0x11},  // 'R'
+    {0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E},  // 'S'
+    {0x11,0x11,0x11,0x15,0x15,0x15,0x0A}   // 'W'
+};
+
+struct HudVertex {
+    GLfloat x, y;   // pixels from the top left of the framebuffer
+    GLfloat u, v;   // texels in the atlas
+};
+
+struct Hud {
+    bool enabled;
+    GLuint ProgramID;
+    GLuint Texture;
+    GLuint VertexArrayID;   // reads HudVertex from the stream buffer
+    GLint ScreenSizeID;
+    GLint TextColorID;
+    char text[HUD_MAX_CHARS];   // what is on screen, to notice changes
+    float fps;
+} hud = { true };
+
+void createHud ()
+{
+  int numGlyphs = sizeof(hudFont) / sizeof(hudFont[0]);
+  int width = numGlyphs * HUD_CELL_WIDTH;
+  vector<GLubyte> atlas(width * HUD_GLYPH_HEIGHT, 0);
+  for (int g = 0; g < numGlyphs; g++)
+    for (int row = 0; row < HUD_GLYPH_HEIGHT; row++)
+      for (int col = 0; col < HUD_GLYPH_WIDTH; col++)
+        if (hudFont[g][row] & (0x10 >> col))
+          atlas[row * width + g * HUD_CELL_WIDTH + col] = 255;
+
+  glGenTextures (1, &hud.Texture);
+  stateBindTexture (hud.Texture);
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_R8, width, HUD_GLYPH_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, &atlas[0]);
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  glGenVertexArrays (1, &hud.VertexArrayID);
+  stateBindVertexArray (hud.VertexArrayID);
+  stateBindBuffer (GL_ARRAY_BUFFER, streamBuffer.Buffer);
+  glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(HudVertex), (void*)0);  // attribute 0. Position and texel
+  stateEnableVertexAttribArray(0);
+  stateBindBuffer (GL_ELEMENT_ARRAY_BUFFER, sharedQuadIndexBuffer());
+
+  hud.text[0] = 0;
+}
+
+/* Append the quads of a line of text, scale screen pixels per font pixel. Each is
+   4 vertices around the glyph, drawn with the shared quad index buffer. */
+void layoutHudText (vector<HudVertex>& vertices, const char* text, GLfloat x, GLfloat y, GLfloat scale)
+{
+  for (; *text; text++, x += HUD_CELL_WIDTH * scale)
+  {
+    const char* glyph = strchr(hudGlyphs, *text);
+    int g = glyph ? glyph - hudGlyphs : 0;
+    if (g == 0)
+      continue;
+
+    GLfloat u = g * HUD_CELL_WIDTH;
+    GLfloat x1 = x + HUD_GLYPH_WIDTH * scale, y1 = y + HUD_GLYPH_HEIGHT * scale;
+    GLfloat u1 = u + HUD_GLYPH_WIDTH;
+    HudVertex quad[4] = {
+      { x, y, u, 0 }, { x1, y, u1, 0 }, { x1, y1, u1, HUD_GLYPH_HEIGHT }, { x, y1, u, HUD_GLYPH_HEIGHT }
+    };
+    vertices.insert(vertices.end(), quad, quad + 4);
+  }
+}
+
+void drawHud (GLint first, GLsizei count)
+{
+  stateUseProgram (hud.ProgramID);
+  stateBlend (false);
+  stateBindTexture (hud.Texture);
+  statePolygonMode (GL_FILL);
+  stateBindVertexArray (hud.VertexArrayID);
+  glUniform2f (hud.ScreenSizeID, framebufferWidth, framebufferHeight);
+  glUniform3f (hud.TextColorID, 0, 0, 0);
+  // All the glyphs in one draw, a longer text than the index buffer reaches in a few
+  for (GLint quad = 0; quad < count / 4; quad += QUAD_INDEX_QUADS)
+    stateDrawElementsBaseVertex (GL_TRIANGLES, 6 * min(count / 4 - quad, QUAD_INDEX_QUADS), GL_UNSIGNED_SHORT, (void*)0, first + 4*quad);
+  stateUseProgram (programID);
+}
+
+/* Per-frame transforms, sent through uniform buffers */
+/* The view-projection goes up once per frame in the "Camera" block and every
+   object transform of the frame goes up in one upload to the transform buffer.
+   The "Transforms" block sees MAX_OBJECT_TRANSFORMS of them at a time, each
+   block of the buffer starts with the identity, and each draw selects its
+   transform with the objectIndex attribute within the block bound for it. */
+#define CAMERA_BINDING 0
+#define TRANSFORMS_BINDING 1
+#define MAX_OBJECT_TRANSFORMS 256  // 2 vec4 each, stays under the 16KB UBO minimum
+#define TRANSFORM_BLOCK_SIZE (MAX_OBJECT_TRANSFORMS*8*sizeof(GLfloat))  // a multiple of any UBO offset alignment
+
+enum DrawKind {
+    DRAW_OBJECT,
+    DRAW_OBSTACLE_BATCH,
+    DRAW_MULTIDRAW_BATCH,
+    DRAW_STATIC_LAYER,
+    DRAW_STREAMED,
+    DRAW_PARTICLES,
+    DRAW_HUD
+};
+
+/* Render queue */
+/* Draws are queued with a 64-bit sort key and radix sorted before they are issued.
+   From the most significant bits: layer (8), program (16), vertex array (24), fill
+   mode (2). Layers give the 2D back to front order, so no depth buffer is needed;
+   inside a layer draws sharing a program and a vertex array end up next to each
+   other. The sort is stable, equal keys keep the order they were queued in. */
+enum DrawLayer {
+    LAYER_BACKGROUND,   // walls, or the cached static layer
+    LAYER_SCENERY,      // power bar frame, cannon base
+    LAYER_POWER_BAR,
+    LAYER_BARREL,
+    LAYER_OBSTACLES,
+    LAYER_EFFECTS,      // projectile trail
+    LAYER_PROJECTILE,
+    LAYER_HUD
+};
+
+struct DrawCommand {
+    GLuint64 key;
+    DrawKind kind;
+    VAO* vao;        // only for DRAW_OBJECT and DRAW_STREAMED
+    int transform;
+    GLint first;     // only for DRAW_STREAMED and DRAW_HUD, vertices in the stream buffer
+    GLsizei count;
+    Mesh* lod;       // only for DRAW_OBJECT and DRAW_OBSTACLE_BATCH, circle level of detail or NULL
+};
+
+/* Frame packets */
+/* draw() advances the game by one tick and records everything the frame shows
+   into a packet without touching GL: the queued draws with their transforms,
+   which obstacles are standing and in view, and copies of the trail, the
+   particles and the laid out HUD text. renderPacket() draws one. With the
+   render thread the two run on different threads, see "Render thread". */
+struct FramePacket {
+    glm::mat4 VP;
+    int width;                        // framebuffer size the packet was laid out for
+    int height;
+    GLfloat pixelsPerUnit;            // on screen, picks the circle levels of detail
+    GLfloat powerBar[4];              // bounds of the power bar as drawn, x0 y0 x1 y1 in world units
+    vector<DrawCommand> draws;
+    vector<GLfloat> transforms;       // 8 per draw, 2x3 affine as two vec4; slot 0 is the identity
+
+    bool obstacleAlive[100];          // obs and Culled of Obstacles[]
+    bool obstacleCulled[100];
+    int numCulled;
+
+    GLfloat trail[TRAIL_LENGTH][2];   // oldest position first
+    vector<HudVertex> hud;
+    int numParticles;
+    vector<GLfloat> particleX, particleY, particleLife;
+    vector<GLuint> particleColor;
+};
+
+vector<DrawCommand> sortedDraws;  // radix sort scratch
+bool sortDraws = true;
+
+/* The program of a draw as it goes into the sort key. Hot reload replaces the GL
+   names on the renderer while draw() builds keys on the simulation thread, so
+   keys carry a fixed slot and the draw functions bind the current name. */
+enum ProgramSlot {
+    PROGRAM_SAMPLE,
+    PROGRAM_CIRCLE,
+    PROGRAM_INSTANCED,
+    PROGRAM_COMPOSITE,
+    PROGRAM_PARTICLES,
+    PROGRAM_HUD
+};
+
+GLuint64 drawSortKey (DrawLayer layer, ProgramSlot program, GLuint vertexArray, GLenum fillMode)
+{
+  return (GLuint64) layer << 56 | (GLuint64) (program & 0xffff) << 40
+       | (GLuint64) (vertexArray & 0xffffff) << 16 | (GLuint64) ((fillMode - GL_POINT) & 3) << 14;
+}
+
+/* Least significant byte first, passes where every key has the same byte are skipped */
+void sortFrameDraws (vector<DrawCommand>& frameDraws)
+{
+  size_t n = frameDraws.size();
+  sortedDraws.resize(n);
+
+  for (int shift = 0; shift < 64; shift += 8)
+  {
+    size_t offsets[256] = {0};
+    for (size_t i = 0; i < n; i++)
+      offsets[(frameDraws[i].key >> shift) & 0xff]++;
+    if (offsets[(frameDraws[0].key >> shift) & 0xff] == n)
+      continue;
+
+    size_t total = 0;
+    for (int b = 0; b < 256; b++)
+    {
+      size_t count = offsets[b];
+      offsets[b] = total;
+      total += count;
+    }
+    for (size_t i = 0; i < n; i++)
+      sortedDraws[offsets[(frameDraws[i].key >> shift) & 0xff]++] = frameDraws[i];
+    frameDraws.swap(sortedDraws);
+  }
+}
+
+void createTransformBuffers ()
+{
+  glGenBuffers (1, &Matrices.CameraBuffer);
+  stateBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+  glBufferData (GL_UNIFORM_BUFFER, sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+  stateBindBufferBase (GL_UNIFORM_BUFFER, CAMERA_BINDING, Matrices.CameraBuffer);
+
+  glGenBuffers (1, &Matrices.TransformBuffer);
+  stateBindBuffer (GL_UNIFORM_BUFFER, Matrices.TransformBuffer);
+  glBufferData (GL_UNIFORM_BUFFER, TRANSFORM_BLOCK_SIZE, NULL, GL_STREAM_DRAW);
+  Matrices.TransformBlocks = 1;
+  stateBindBufferBase (GL_UNIFORM_BUFFER, TRANSFORMS_BINDING, Matrices.TransformBuffer);
+}
+
+/* Attach the uniform blocks of a program to their binding points */
+void bindTransformBlocks (GLuint program)
+{
+  GLuint camera = glGetUniformBlockIndex(program, "Camera");
+  if (camera != GL_INVALID_INDEX)
+    glUniformBlockBinding(program, camera, CAMERA_BINDING);
+
+  GLuint transforms = glGetUniformBlockIndex(program, "Transforms");
+  if (transforms != GL_INVALID_INDEX)
+    glUniformBlockBinding(program, transforms, TRANSFORMS_BINDING);
+}
+
+/* Add a transform to a packet, the first slot of every block is the identity */
+int addTransform (FramePacket& packet, const GLfloat transform[8])
+{
+  static const GLfloat identity[8] = { 1,0,0,0, 0,1,0,0 };
+  if (packet.transforms.size() / 8 % MAX_OBJECT_TRANSFORMS == 0)
+    packet.transforms.insert(packet.transforms.end(), identity, identity + 8);
+  int index = packet.transforms.size() / 8;
+  packet.transforms.insert(packet.transforms.end(), transform, transform + 8);
+  return index;
+}
+
+/* Empty a packet, slot 0 is the identity transform */
+void clearPacket (FramePacket& packet)
+{
+  static const GLfloat identity[8] = { 1,0,0,0, 0,1,0,0 };
+  packet.draws.clear();
+  packet.transforms.assign(identity, identity + 8);
+  packet.hud.clear();
+  packet.numParticles = 0;
+}
+
+/* Start recording a frame seen through VP at the current framebuffer size */
+void beginPacket (FramePacket& packet, glm::mat4 VP)
+{
+  clearPacket(packet);
+  packet.VP = VP;
+  packet.width = viewWidth;
+  packet.height = viewHeight;
+  // The ortho of reshapeWindow spans zoom*8 units either way
+  packet.pixelsPerUnit = max(viewWidth, viewHeight) / (zoom*8.0f);
+}
+
+/* GPU profiler */
+/* --gpu-profile[=FILE] times each draw layer of the frame on the GPU and on the
+   CPU. A GL_TIMESTAMP query goes in where a layer starts and one where the frame
+   ends, so a layer takes the difference of two timestamps; unlike GL_TIME_ELAPSED
+   these may sit inside the scene query of dynamic resolution. The queries of a
+   frame are read back PROFILER_FRAMES frames later; a frame whose slot of the
+   ring is still waiting for the GPU is not profiled rather than waited for.
+   Background includes redrawing the static layer, the HUD the upscale before it.
+   The CPU time of a pass leaves out issuing the queries, which some drivers
+   (llvmpipe) make wait for the work queued before them; that time is reported
+   on its own. Averages are printed every second and a summary is written at
+   exit. */
+#define PROFILER_FRAMES 4
+#define PROFILER_PASSES (LAYER_HUD + 1)
+
+static const char* layerNames[PROFILER_PASSES] = {
+    "background", "scenery", "powerbar", "barrel", "obstacles", "effects", "projectile", "hud"
+};
+
+double currentTime();
+
+struct ProfilerFrame {
+    GLuint Queries[PROFILER_PASSES + 1];   // start of each pass, then the end of the frame
+    int layers[PROFILER_PASSES];
+    double cpuMs[PROFILER_PASSES];
+    int numPasses;
+    bool pending;                          // queries issued, not read back yet
+};
+
+struct PassStats {
+    int frames;
+    double gpuMs, cpuMs;
+    double maxGpuMs, maxCpuMs;
+};
+
+struct GpuProfiler {
+    bool enabled;
+    string path;
+    ProfilerFrame frames[PROFILER_FRAMES];
+    int next;                   // slot of the next frame
+    ProfilerFrame* current;     // frame being issued, NULL while not profiling it
+    double passStart;
+    PassStats total[PROFILER_PASSES + 1];    // whole run, the last entry is the frame
+    PassStats recent[PROFILER_PASSES + 1];   // since the last report
+    int profiled;
+    int skipped;
+    double lastReport;
+    int issued;                 // frames whose queries were issued, whole run
+    int recentIssued;           // since the last report
+    double queryMs;             // CPU time spent issuing their queries
+    double recentQueryMs;
+} gpuProfiler = { false, "gpu_profile.txt" };
+
+void createGpuProfiler ()
+{
+  if (!gpuProfiler.enabled)
+    return;
+
+  GLint bits = 0;
+  glGetQueryiv (GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &bits);
+  if (bits == 0)
+  {
+    fprintf(stderr, "GPU profiler: no timestamp queries on this driver\n");
+    gpuProfiler.enabled = false;
+    return;
+  }
+  for (int i = 0; i < PROFILER_FRAMES; i++)
+    glGenQueries (PROFILER_PASSES + 1, gpuProfiler.frames[i].Queries);
+  gpuProfiler.lastReport = currentTime();
+}
+
+void addPassTime (PassStats& stats, double gpuMs, double cpuMs)
+{
+  stats.frames++;
+  stats.gpuMs += gpuMs;
+  stats.cpuMs += cpuMs;
+  stats.maxGpuMs = max(stats.maxGpuMs, gpuMs);
+  stats.maxCpuMs = max(stats.maxCpuMs, cpuMs);
+}
+
+/* Read back the frames whose queries have all finished, without waiting */
+void collectGpuProfile ()
+{
+  for (int i = 0; i < PROFILER_FRAMES; i++)
+  {
+    ProfilerFrame& frame = gpuProfiler.frames[i];
+    if (!frame.pending)
+      continue;
+    // Timestamps complete in order, the last one being ready means all are
+    GLint available = 0;
+    glGetQueryObjectiv (frame.Queries[frame.numPasses], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      continue;
+
+    GLuint64 times[PROFILER_PASSES + 1];
+    for (int p = 0; p <= frame.numPasses; p++)
+      glGetQueryObjectui64v (frame.Queries[p], GL_QUERY_RESULT, &times[p]);
+
+    double frameCpuMs = 0;
+    for (int p = 0; p < frame.numPasses; p++)
+    {
+      double gpuMs = (times[p + 1] - times[p]) / 1e6;
+      addPassTime(gpuProfiler.total[frame.layers[p]], gpuMs, frame.cpuMs[p]);
+      addPassTime(gpuProfiler.recent[frame.layers[p]], gpuMs, frame.cpuMs[p]);
+      frameCpuMs += frame.cpuMs[p];
+    }
+    double frameGpuMs = (times[frame.numPasses] - times[0]) / 1e6;
+    addPassTime(gpuProfiler.total[PROFILER_PASSES], frameGpuMs, frameCpuMs);
+    addPassTime(gpuProfiler.recent[PROFILER_PASSES], frameGpuMs, frameCpuMs);
+
+    gpuProfiler.profiled++;
+    frame.pending = false;
+  }
+}
+
+/* Issue a timestamp query, its CPU cost counted apart from the passes */
+void profileTimestamp (GLuint query)
+{
+  double start = currentTime();
+  glQueryCounter (query, GL_TIMESTAMP);
+  double now = currentTime();
+  gpuProfiler.queryMs += 1000 * (now - start);
+  gpuProfiler.recentQueryMs += 1000 * (now - start);
+  gpuProfiler.passStart = now;
+}
+
+/* Start timing a pass drawing layer, unless the frame is already in it */
+void profilePass (int layer)
+{
+  ProfilerFrame* frame = gpuProfiler.current;
+  if (!frame || (frame->numPasses > 0 && frame->layers[frame->numPasses - 1] == layer))
+    return;
+
+  if (frame->numPasses > 0)
+    frame->cpuMs[frame->numPasses - 1] = 1000 * (currentTime() - gpuProfiler.passStart);
+  profileTimestamp(frame->Queries[frame->numPasses]);
+  frame->layers[frame->numPasses++] = layer;
+}
+
+void profileBeginFrame ()
+{
+  if (!gpuProfiler.enabled)
+    return;
+  collectGpuProfile();
+
+  ProfilerFrame& frame = gpuProfiler.frames[gpuProfiler.next];
+  if (frame.pending)
+  {
+    gpuProfiler.skipped++;
+    return;
+  }
+  frame.numPasses = 0;
+  gpuProfiler.current = &frame;
+  profilePass(LAYER_BACKGROUND);
+}
+
+void printPassTimes (FILE* file, const char* name, const PassStats& stats)
+{
+  if (stats.frames)
+    fprintf(file, "%-12s %8.3f %8.3f %8.3f %8.3f %8d\n", name, stats.gpuMs / stats.frames, stats.maxGpuMs,
+            stats.cpuMs / stats.frames, stats.maxCpuMs, stats.frames);
+}
+
+void profileEndFrame ()
+{
+  ProfilerFrame* frame = gpuProfiler.current;
+  if (!frame)
+    return;
+
+  frame->cpuMs[frame->numPasses - 1] = 1000 * (currentTime() - gpuProfiler.passStart);
+  profileTimestamp(frame->Queries[frame->numPasses]);
+  frame->pending = true;
+  gpuProfiler.issued++;
+  gpuProfiler.recentIssued++;
+  double now = gpuProfiler.passStart;
+  gpuProfiler.current = NULL;
+  gpuProfiler.next = (gpuProfiler.next + 1) % PROFILER_FRAMES;
+
+  if (now - gpuProfiler.lastReport >= 1)
+  {
+    printf("GPU/CPU ms per frame:");
+    for (int layer = 0; layer <= PROFILER_PASSES; layer++)
+    {
+      const PassStats& stats = gpuProfiler.recent[layer];
+      if (stats.frames)
+        printf(" %s %.3f/%.3f", layer < PROFILER_PASSES ? layerNames[layer] : "total",
+               stats.gpuMs / stats.frames, stats.cpuMs / stats.frames);
+      gpuProfiler.recent[layer] = PassStats();
+    }
+    printf(" queries -/%.3f\n", gpuProfiler.recentQueryMs / gpuProfiler.recentIssued);
+    gpuProfiler.recentQueryMs = 0;
+    gpuProfiler.recentIssued = 0;
+    gpuProfiler.lastReport = now;
+  }
+}
+
+/* Write the averages and maxima of the whole run */
+void writeGpuProfile ()
+{
+  if (!gpuProfiler.enabled)
+    return;
+  FILE* file = fopen(gpuProfiler.path.c_str(), "w");
+  if (!file)
+  {
+    fprintf(stderr, "GPU profiler: cannot write %s\n", gpuProfiler.path.c_str());
+    return;
+  }
+
+  fprintf(file, "GPU profile of %s: %d frames profiled, %d skipped while the ring was in flight\n",
+          (const char*) glGetString(GL_RENDERER), gpuProfiler.profiled, gpuProfiler.skipped);
+  fprintf(file, "%-12s %8s %8s %8s %8s %8s\n", "pass (ms)", "gpu avg", "gpu max", "cpu avg", "cpu max", "frames");
+  for (int layer = 0; layer < PROFILER_PASSES; layer++)
+    printPassTimes(file, layerNames[layer], gpuProfiler.total[layer]);
+  printPassTimes(file, "frame", gpuProfiler.total[PROFILER_PASSES]);
+  if (gpuProfiler.issued)
+    fprintf(file, "%-12s %8s %8s %8.3f %8s %8d\n", "queries", "-", "-", gpuProfiler.queryMs / gpuProfiler.issued, "-", gpuProfiler.issued);
+  fclose(file);
+
+  printf("GPU profile written to %s\n", gpuProfiler.path.c_str());
+}
+
+// Set by renderPacket: stretch the scene onto the framebuffer before the HUD layer,
+// and time each layer of the frame
+bool resolveBeforeHud = false;
+bool profileLayers = false;
+
+/* Copy the packet's trail and HUD vertices into the stream buffer, where their draws read them */
+void streamPacketData (FramePacket& packet)
+{
+  for (size_t i = 0; i < packet.draws.size(); i++)
+  {
+    DrawCommand& command = packet.draws[i];
+    if (command.kind == DRAW_STREAMED)
+      command.first = streamVertices(&packet.trail[command.first][0], command.count);
+    else if (command.kind == DRAW_HUD)
+      command.first = streamData(&packet.hud[command.first], command.count, sizeof(HudVertex));
+    else
+      continue;
+    if (command.first < 0)
+      command.count = 0;
+  }
+}
+
+/* Issue one queued draw, with the block of its transform bound */
+void issueDraw (FramePacket& packet, const DrawCommand& command)
+{
+  switch (command.kind) {
+    case DRAW_OBJECT:
+      stateObjectIndex(command.transform % MAX_OBJECT_TRANSFORMS);
+      if (command.lod) {
+        // The same object, drawn with the fan picked for its size on screen
+        VAO lod = *command.vao;
+        lod.VertexArrayID = command.lod->VertexArrayID;
+        lod.NumVertices = command.lod->NumVertices;
+        lod.IndexBuffer = command.lod->IndexBuffer;
+        lod.NumIndices = command.lod->NumIndices;
+        draw3DObject(&lod);
+      }
+      else
+        draw3DObject(command.vao);
+      break;
+    case DRAW_OBSTACLE_BATCH:
+      drawObstacleBatch(command.lod);
+      break;
+    case DRAW_MULTIDRAW_BATCH:
+      stateObjectIndex(0);
+      drawMultiDrawBatch();
+      break;
+    case DRAW_STATIC_LAYER:
+      drawStaticLayer();
+      break;
+    case DRAW_STREAMED:
+      stateObjectIndex(command.transform % MAX_OBJECT_TRANSFORMS);
+      if (command.count > 0)
+        drawStreamed3DObject(command.vao, command.first, command.count);
+      break;
+    case DRAW_PARTICLES:
+      drawParticles(packet.numParticles, &packet.particleX[0], &packet.particleY[0], &packet.particleLife[0], &packet.particleColor[0]);
+      break;
+    case DRAW_HUD:
+      if (command.count > 0)
+        drawHud(command.first, command.count);
+      break;
+  }
+}
+
+/* Upload the transforms of a packet and issue its draws in sorted order. A
+   draw with a transform of its own binds the block holding it if another one
+   is bound; the rest use the identity that starts every block. */
+void flushFrame (FramePacket& packet)
+{
+  vector<DrawCommand>& frameDraws = packet.draws;
+  int numTransforms = packet.transforms.size() / 8;
+
+  streamPacketData(packet);
+  if (sortDraws && frameDraws.size() > 1)
+    sortFrameDraws(frameDraws);
+
+  int blocks = (numTransforms + MAX_OBJECT_TRANSFORMS - 1) / MAX_OBJECT_TRANSFORMS;
+  Matrices.TransformBlocks = max(Matrices.TransformBlocks, blocks);
+  stateBindBuffer (GL_UNIFORM_BUFFER, Matrices.TransformBuffer);
+  glBufferData (GL_UNIFORM_BUFFER, Matrices.TransformBlocks*TRANSFORM_BLOCK_SIZE, NULL, GL_STREAM_DRAW);  // orphan the last frame's data
+  glBufferSubData (GL_UNIFORM_BUFFER, 0, numTransforms*8*sizeof(GLfloat), &packet.transforms[0]);
+  stateBindBufferRange (GL_UNIFORM_BUFFER, TRANSFORMS_BINDING, Matrices.TransformBuffer, 0, TRANSFORM_BLOCK_SIZE);
+  int bound = 0;
+
+  for (size_t i = 0; i < frameDraws.size(); i++)
+  {
+    const DrawCommand& command = frameDraws[i];
+    if (profileLayers)
+      profilePass(command.key >> 56);
+    if (resolveBeforeHud && command.key >> 56 >= LAYER_HUD)
+    {
+      resolveScene();
+      resolveBeforeHud = false;
+    }
+    int block = command.transform / MAX_OBJECT_TRANSFORMS;
+    if (command.transform % MAX_OBJECT_TRANSFORMS != 0 && block != bound)
+    {
+      stateBindBufferRange (GL_UNIFORM_BUFFER, TRANSFORMS_BINDING, Matrices.TransformBuffer,
+                            block*TRANSFORM_BLOCK_SIZE, TRANSFORM_BLOCK_SIZE);
+      bound = block;
+    }
+    issueDraw(packet, command);
+  }
+}
+
+/* Queue a VAO for this frame with its model matrix, packed as a 2x3 affine transform */
+void submit3DObject (FramePacket& packet, VAO* vao, glm::mat4 model, DrawLayer layer)
+{
+  bool identity = model == glm::mat4(1.0f) && vao->PositionOffset[0] == 0 && vao->PositionOffset[1] == 0
+                  && vao->PositionScale[0] == 1 && vao->PositionScale[1] == 1;
+  DrawCommand command = { drawSortKey(layer, vao->Sdf ? PROGRAM_CIRCLE : PROGRAM_SAMPLE, vao->VertexArrayID, vao->FillMode),
+                          DRAW_OBJECT, vao, 0 };
+
+  if (!identity)
+  {
+    // Fold the dequantization of packed positions into the model matrix
+    model *= glm::translate(glm::vec3(vao->PositionOffset[0], vao->PositionOffset[1], 0));
+    model *= glm::scale(glm::vec3(vao->PositionScale[0], vao->PositionScale[1], 1));
+
+    GLfloat transform[8] = { model[0][0], model[1][0], model[3][0], 0,
+                             model[0][1], model[1][1], model[3][1], 0 };
+    command.transform = addTransform(packet, transform);
+  }
+
+  if (vao->Sides && circleLods)
+  {
+    // The unit fan is as many world units across as the longer axis of the transform
+    GLfloat scale = max(sqrt(model[0][0]*model[0][0] + model[0][1]*model[0][1]),
+                        sqrt(model[1][0]*model[1][0] + model[1][1]*model[1][1]));
+    command.lod = circleLodMesh(vao->Sides, scale * packet.pixelsPerUnit);
+    command.key = drawSortKey(layer, PROGRAM_SAMPLE, command.lod->VertexArrayID, vao->FillMode);
+  }
+  packet.draws.push_back(command);
+}
+
+/* Queue the instanced obstacle batch */
+void submitObstacleBatch (FramePacket& packet)
+{
+  DrawCommand command = { drawSortKey(LAYER_OBSTACLES, PROGRAM_INSTANCED, obstacleBatch.VertexArrayID, GL_FILL),
+                          DRAW_OBSTACLE_BATCH, NULL, 0 };
+
+  if (obstacleBatch.Sides && circleLods)
+  {
+    // One fan for every instance, as fine as the largest one standing in view needs
+    GLfloat radius = 0;
+    for (int i = 0; i < obstacleBatch.NumInstances; i++)
+      if (obstacleBatch.Members[i]->obs && !obstacleBatch.Members[i]->Culled)
+        radius = max(radius, obstacleBatch.Members[i]->radius);
+    command.lod = circleLodMesh(obstacleBatch.Sides, radius * packet.pixelsPerUnit);
+  }
+  packet.draws.push_back(command);
+}
+
+/* Queue the multi-draw of all live obstacles */
+void submitMultiDrawBatch (FramePacket& packet)
+{
+  DrawCommand command = { drawSortKey(LAYER_OBSTACLES, sdfCircles ? PROGRAM_CIRCLE : PROGRAM_SAMPLE, multiDrawBatch.VertexArrayID, GL_FILL),
+                          DRAW_MULTIDRAW_BATCH, NULL, 0 };
+  packet.draws.push_back(command);
+}
+
+/* Queue the composite of the cached static layer */
+void submitStaticLayer (FramePacket& packet)
+{
+  DrawCommand command = { drawSortKey(LAYER_BACKGROUND, PROGRAM_COMPOSITE, staticLayer.VertexArrayID, GL_FILL),
+                          DRAW_STATIC_LAYER, NULL, 0 };
+  packet.draws.push_back(command);
+}
+
+/* Record which obstacles are standing and which are out of view */
+void submitObstacles (FramePacket& packet)
+{
+  for (int k = 0; k < add; k++)
+  {
+    packet.obstacleAlive[k] = Obstacles[k]->obs;
+    packet.obstacleCulled[k] = Obstacles[k]->Culled;
+  }
+  packet.numCulled = viewCulling.culled;
+}
+
+/* Take over the obstacles of a packet, the batches are rebuilt only when they changed */
+void applyObstacles (const FramePacket& packet)
+{
+  for (int k = 0; k < add; k++)
+  {
+    VAO* obstacle = Obstacles[k];
+    if (obstacle->DrawnAlive == packet.obstacleAlive[k] && obstacle->DrawnCulled == packet.obstacleCulled[k])
+      continue;
+    obstacle->DrawnAlive = packet.obstacleAlive[k];
+    obstacle->DrawnCulled = packet.obstacleCulled[k];
+    obstacleBatch.dirty = true;
+    multiDrawBatch.dirty = true;
+  }
+}
+
+/* Queue the projectile trail, oldest position first, streamed in world coordinates */
+void submitTrail (FramePacket& packet)
+{
+  if (trailCount < 2)
+    return;
+
+  int oldest = (trailHead - trailCount + TRAIL_LENGTH) % TRAIL_LENGTH;
+  for (int i = 0; i < trailCount; i++)
+  {
+    packet.trail[i][0] = trailPoints[(oldest + i) % TRAIL_LENGTH][0];
+    packet.trail[i][1] = trailPoints[(oldest + i) % TRAIL_LENGTH][1];
+  }
+
+  // first indexes packet.trail until the points are streamed
+  DrawCommand command = { drawSortKey(LAYER_EFFECTS, PROGRAM_SAMPLE, streamBuffer.VertexArrayID, trail.FillMode),
+                          DRAW_STREAMED, &trail, 0, 0, trailCount };
+  packet.draws.push_back(command);
+}
+
+/* Queue the impact particles, above the obstacles they come out of */
+void submitParticles (FramePacket& packet)
+{
+  int n = particles.count;
+  if (n == 0)
+    return;
+
+  packet.numParticles = n;
+  packet.particleX.assign(particles.x, particles.x + n);
+  packet.particleY.assign(particles.y, particles.y + n);
+  packet.particleLife.assign(particles.life, particles.life + n);
+  packet.particleColor.assign(particles.color, particles.color + n);
+
+  DrawCommand command = { drawSortKey(LAYER_EFFECTS, PROGRAM_PARTICLES, particleRenderer.VertexArrayID, GL_FILL),
+                          DRAW_PARTICLES, NULL, 0 };
+  packet.draws.push_back(command);
+}
+
+/* Queue the HUD text, marking it damaged when it differs from what is on screen */
+void submitHud (FramePacket& packet, const char* lines[], int numLines)
+{
+  char text[HUD_MAX_CHARS] = "";
+  for (int i = 0; i < numLines; i++)
+    strncat(text, lines[i], sizeof(text) - strlen(text) - 1);
+  if (strcmp(text, hud.text) != 0)
+  {
+    strcpy(hud.text, text);
+    markDamage(DAMAGE_HUD);
+  }
+
+  // Whole font pixels, about 1/200 of the height
+  GLfloat scale = max(1, packet.height / 200);
+  GLfloat margin = 4 * scale + packet.height / 40;
+
+  for (int i = 0; i < numLines; i++)
+    layoutHudText(packet.hud, lines[i], margin, margin + i * (HUD_GLYPH_HEIGHT + 3) * scale, scale);
+  if (packet.hud.empty())
+    return;
+
+  // first indexes packet.hud until the vertices are streamed
+  DrawCommand command = { drawSortKey(LAYER_HUD, PROGRAM_HUD, hud.VertexArrayID, GL_FILL),
+                          DRAW_HUD, NULL, 0, 0, (GLsizei) packet.hud.size() };
+  packet.draws.push_back(command);
+}
+
+/* Static scene - the background, walls and cannon base never move */
+VAO* staticObjects[7];
+DrawLayer staticObjectLayers[7];
+int numStaticObjects;
+
+void submitStaticObjects (FramePacket& packet)
+{
+  for (int i = 0; i < numStaticObjects; i++)
+    submit3DObject(packet, staticObjects[i], glm::mat4(1.0f), staticObjectLayers[i]);
+}
+
+/* Render the static scene into the cached layer, only after a zoom, resize or reload */
+void renderStaticLayer (const FramePacket& frame)
+{
+  if (!staticLayer.dirty && staticLayer.VP == frame.VP)
+    return;
+
+  static FramePacket packet;
+  clearPacket(packet);
+  packet.pixelsPerUnit = frame.pixelsPerUnit;
+  submitStaticObjects(packet);
+
+  stateBindFramebuffer (staticLayer.Framebuffer);
+  glViewport (0, 0, staticLayer.width, staticLayer.height);
+  glClear (GL_COLOR_BUFFER_BIT);
+  flushFrame(packet);
+  stateBindFramebuffer (sceneFramebuffer);
+
+  staticLayer.VP = frame.VP;
+  staticLayer.dirty = false;
+}
 
 float camera_rotation_angle = 90;
 
@@ -957,15 +3310,8 @@ GLfloat x_c,y_c,sp_x, sp_y, tspeed , yspeed, xspeed, angle , e,sx,fla ;
 GLfloat g , flag;
 GLfloat rectangle_rotation, triangle_rotation;
 int score;
-void draw ()
+void draw (FramePacket& packet)
 {
-  // clear the color and depth in the frame buffer
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-  // use the loaded shader program
-  // Don't change unless you know what you are doing
-  glUseProgram (programID);
-
   // Eye - Location of camera. Don't change unless you are sure!!
   glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
   // Target - Where is the camera looking at.  Don't change unless you are sure!!
@@ -982,65 +3328,37 @@ void draw ()
   //  Don't change unless you are sure!!
   glm::mat4 VP = Matrices.projection * Matrices.view;
 
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
+  // The ViewProject matrix goes up once for the whole frame, in the "Camera" uniform block
+  // Each model you render is queued in the packet with its own model matrix and drawn by renderPacket()
   //  Don't change unless you are sure!!
-  glm::mat4 MVP;  // MVP = Projection * View * Model
-
-  // Load identity to model matrix
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle2);
-
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle3);
-
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle4);
-
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle5);
-
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle6);
+  beginPacket(packet, VP);
 
+  // Background, walls and cannon base - re-rendered into the cache only after zoom or resize
+  if (staticLayerEnabled)
+    submitStaticLayer(packet);
+  else
+    submitStaticObjects(packet);
 
   // Matrices.model = glm::mat4(1.0f);
   // MVP = VP * Matrices.model;
   // glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
   // draw3DObject(triangle);
 
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(circle4);
-
-  Matrices.model = glm::mat4(1.0f);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(circle5);
-
 
   Matrices.model = glm::mat4(1.0f);
   glm::mat4 translateRectangle7 = glm::translate (glm::vec3(sx ,0.0 , 0));
   Matrices.model *= translateRectangle7;
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle7);
+  submit3DObject(packet, rectangle7, Matrices.model, LAYER_POWER_BAR);
+  packet.powerBar[0] = rectangle7->x_centre + sx - rectangle7->radius;
+  packet.powerBar[1] = rectangle7->y_centre - rectangle7->radius;
+  packet.powerBar[2] = rectangle7->x_centre + sx + rectangle7->radius;
+  packet.powerBar[3] = rectangle7->y_centre + rectangle7->radius;
   if(!space)
   {
     if(sx >= 1.0 || sx <= -1.0)
       fla*= -1;
     sx+= fla*0.01;
+    markDamage(DAMAGE_POWER_BAR);
  //   cout << sx << endl;
   }
   Matrices.model = glm::mat4(1.0f);
@@ -1051,9 +3369,7 @@ void draw ()
   glm::mat4 rectangleTransform = invtranslateRectangle*rotateRectangle*translateRectangle;
   Matrices.model *= rectangleTransform; 
 
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(rectangle1);
+  submit3DObject(packet, rectangle1, Matrices.model, LAYER_BARREL);
 
   float increments = 1;
   if(rectangle_rot_status==true)
@@ -1063,11 +3379,14 @@ void draw ()
     if(rectangle_rot_dir==-1 && rectangle_rotation>=10)
       rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
     rectangle_rot_status=false;
+    markDamage(DAMAGE_AIM);
     angle=rectangle_rotation*M_PI/180.0f;
     triangle_rotation = rectangle_rotation;
   }
 
 
+  cullObstacles(VP);
+
   int k = add;
   while(k--)
   {
@@ -1081,8 +3400,8 @@ void draw ()
       if(d <= dis)
       { 
         score += 5;
-        cout << "Score = " << score << endl;
         Obstacles[k]->obs = false;
+        spawnImpact(Obstacles[k]);
         if(triangle_translationY<0)
           u = sqrt(-4*triangle_translationY);
         else
@@ -1093,19 +3412,26 @@ void draw ()
         sp_y = y_c;
        // cout << "u =" << u << " angle = " << angle << " x = " << sp_x << " y = " << sp_y << " uy = " << u*sin(angle) << "\n";
         t = 0.08;
+        markDamage(DAMAGE_OBSTACLES);
         break;
       }
-      if(Obstacles[k]->obs)
+      if(Obstacles[k]->obs && !Obstacles[k]->Culled && !batchedObstacle(Obstacles[k]))
       {
         Matrices.model = glm::mat4(1.0f);
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-        draw3DObject(Obstacles[k]);
+        submit3DObject(packet, Obstacles[k], Matrices.model, LAYER_OBSTACLES);
       }
     }
   }
 
+  submitObstacles(packet);
+  if(obstacleMode == OBSTACLES_INSTANCED)
+    submitObstacleBatch(packet);
+  else if(obstacleMode == OBSTACLES_MULTIDRAW)
+    submitMultiDrawBatch(packet);
+
+  // Impact bursts fall like the cannonball, g is in translation units, 5 per world unit
+  updateParticles(tspeed, g / 5);
+  submitParticles(packet);
 
   if(space)
   { 
@@ -1127,17 +3453,16 @@ void draw ()
     glm::mat4 rotateconnon = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
     glm::mat4 cannonTransform = translatecannon*rotateconnon;
     Matrices.model *= cannonTransform; 
-    MVP = VP * Matrices.model; // MVP = p * V * M
 
-    //  Don't change unless you are sure!!
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    submitTrail(packet);
 
-    // draw3DObject draws the VAO given to it using current MVP matrix
-    draw3DObject(cannon);
+    // submit3DObject queues the VAO with its model matrix and layer, drawn when the packet is rendered
+    submit3DObject(packet, cannon, Matrices.model, LAYER_PROJECTILE);
     
 
     x_c = sp_x + triangle_translationX/20.0f;
     y_c = sp_y + triangle_translationY/5.0f;
+    recordTrail(x_c, y_c);
 
     
     if(y_c <= -3.1)
@@ -1152,6 +3477,7 @@ void draw ()
       u = e*u;
     }
 
+    GLfloat last_translationX = triangle_translationX, last_translationY = triangle_translationY;
     if(u < e*e*e*e*14)
     {
       triangle_translationX = 0;
@@ -1174,22 +3500,418 @@ void draw ()
       
       t=t+tspeed;
     }
+    if(triangle_translationX != last_translationX || triangle_translationY != last_translationY)
+      markDamage(DAMAGE_PROJECTILE);
+  }
+
+
+  //cout << "x aftr collision = " << x_c << " y after collison " << y_c << " y speed =" << yspeed << " x speed = " << u*cos(angle) << "\n";
+
+  // if(triangle_translationX>70)
+  //   triangle_translationX=1;
+
+  // else if (triangle_translationX<2)
+  // {
+  //   triangle_translationX=1;
+  // }
+
+  // Score and the shot parameters, the power bar is strongest in the middle.
+  // sx steps past +-1 before it turns around, so the readout stops at 0%
+  if (hud.enabled)
+  {
+    char lines[4][32];
+    snprintf(lines[0], sizeof(lines[0]), "SCORE %d", score);
+    snprintf(lines[1], sizeof(lines[1]), "ANGLE %.0f", rectangle_rotation);
+    snprintf(lines[2], sizeof(lines[2]), "POWER %.0f%%", max(0.0f, 1 - fabs(sx)) * 100);
+    snprintf(lines[3], sizeof(lines[3]), "FPS %.0f", hud.fps);
+    const char* text[4] = { lines[0], lines[1], lines[2], lines[3] };
+    submitHud(packet, text, 4);
+  }
+
+  // printf("%d\n",triangle_translationX );
+}
+
+/* Draw a packet recorded by draw() */
+void renderPacket (FramePacket& packet)
+{
+  if (packet.width != framebufferWidth || packet.height != framebufferHeight)
+    resizeFramebuffer(packet.width, packet.height);
+  applyObstacles(packet);
+
+  stateBeginFrame();
+  streamBeginFrame();
+  stateUseProgram (programID);
+  profileBeginFrame();
+
+  // The view-projection of the frame, in the "Camera" uniform block
+  stateBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+  glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), &packet.VP[0][0]);
+
+  if (staticLayerEnabled)
+    renderStaticLayer(packet);
+
+  // The scene goes to its own target when dynamic resolution scales it
+  stateBindFramebuffer (sceneFramebuffer);
+  glViewport (0, 0, sceneWidth, sceneHeight);
+  beginPartialRedraw(packet.VP, packet.powerBar, presentDamage.exchange(0));
+  beginSceneTiming();
+
+  // clear the color in the frame buffer - the static layer covers all of it
+  if (!staticLayerEnabled)
+    glClear (GL_COLOR_BUFFER_BIT);
+
+  // Upload this frame's transforms and draw everything queued
+  resolveBeforeHud = true;
+  profileLayers = true;
+  flushFrame(packet);
+  if (resolveBeforeHud)
+    resolveScene();
+  resolveBeforeHud = false;
+  profileLayers = false;
+  profileEndFrame();
+  streamEndFrame();
+}
+
+/* Shader hot reload */
+/* With --hot-reload a thread watches the directories of the shader files with
+   inotify. Once a written file has settled it preprocesses the sources of every
+   program made from it, includes too, and hands them over. Between two frames the renderer compiles and
+   links them - in the background when the driver has ARB_parallel_shader_compile,
+   so the loop only polls for completion, at once otherwise. A program replaces
+   the old one only if it links, then its uniform blocks and locations are looked
+   up again. At exit the watcher is woken through an eventfd and joined. */
+#define RELOAD_SETTLE_MS 50  // editors save in several steps
+
+struct WatchedProgram {
+    GLuint* ProgramID;
+    string vertexPath;
+    string fragmentPath;
+    vector<string> files;   // the shaders and what they include, watcher only once it runs
+};
+
+struct ReloadRequest {
+    int program;            // index into shaderReload.programs
+    string vertexCode;
+    string fragmentCode;
+    GLuint VertexShaderID;
+    GLuint FragmentShaderID;
+    GLuint ProgramID;
+};
+
+struct ShaderReload {
+    bool enabled;
+    vector<WatchedProgram> programs;   // fixed once the watcher runs
+    thread watcher;
+    int inotifyFd;
+    int wakeFd;                        // written to stop the watcher
+    atomic<bool> stopping;
+    mutex lock;
+    vector<ReloadRequest> ready;       // sources read by the watcher, guarded by lock
+    vector<ReloadRequest> compiling;   // renderer only
+    bool wakeEvents;                   // wake a main loop idling in glfwWaitEventsTimeout
+} shaderReload;
+
+/* Look up what the programs need from outside, again after every reload */
+void bindProgramResources ()
+{
+  bindTransformBlocks(programID);
+  bindTransformBlocks(circleProgramID);
+  bindTransformBlocks(instancedProgramID);
+  bindTransformBlocks(particleRenderer.ProgramID);
+
+  if (hud.enabled)
+  {
+    hud.ScreenSizeID = glGetUniformLocation(hud.ProgramID, "screenSize");
+    hud.TextColorID = glGetUniformLocation(hud.ProgramID, "textColor");
+  }
+}
+
+void watchShaders (GLuint* program, const char* vertexPath, const char* fragmentPath)
+{
+  WatchedProgram watched = { program, vertexPath, fragmentPath };
+  shaderReload.programs.push_back(watched);
+}
+
+void shaderWatcher (int fd, vector< pair<int, string> > watches)
+{
+  alignas(inotify_event) char buffer[4096];
+
+  while (true)
+  {
+    // Collect the changed files until they have been quiet for a moment
+    vector<string> changed;
+    pollfd events[2] = { { fd, POLLIN, 0 }, { shaderReload.wakeFd, POLLIN, 0 } };
+    int timeout = -1;
+    int ready;
+    while ((ready = poll(events, 2, timeout)) > 0)
+    {
+      if (shaderReload.stopping)
+        return;
+      ssize_t length = read(fd, buffer, sizeof(buffer));
+      if (length <= 0)
+        return;
+      for (char* at = buffer; at < buffer + length; )
+      {
+        inotify_event* event = (inotify_event*) at;
+        for (size_t i = 0; i < watches.size() && event->len; i++)
+          if (watches[i].first == event->wd)
+            changed.push_back(watches[i].second == "." ? string(event->name) : watches[i].second + "/" + event->name);
+        at += sizeof(inotify_event) + event->len;
+      }
+      timeout = RELOAD_SETTLE_MS;
+    }
+    if ((ready < 0 && errno != EINTR) || shaderReload.stopping)
+      return;
+
+    for (size_t i = 0; i < shaderReload.programs.size(); i++)
+    {
+      WatchedProgram& watched = shaderReload.programs[i];
+      bool used = false;
+      for (size_t f = 0; f < watched.files.size() && !used; f++)
+        used = find(changed.begin(), changed.end(), watched.files[f]) != changed.end();
+      if (!used)
+        continue;
+
+      vector<string> vertexFiles, fragmentFiles;
+      ReloadRequest request = { (int) i, preprocessShader(watched.vertexPath.c_str(), &vertexFiles),
+                                preprocessShader(watched.fragmentPath.c_str(), &fragmentFiles) };
+      // What it includes now, new includes are picked up where a watched directory is
+      watched.files = vertexFiles;
+      watched.files.insert(watched.files.end(), fragmentFiles.begin(), fragmentFiles.end());
+      if (request.vertexCode.empty() || request.fragmentCode.empty())
+        continue;  // caught between a delete and a rename
+
+      lock_guard<mutex> guard(shaderReload.lock);
+      shaderReload.ready.push_back(request);
+      if (shaderReload.wakeEvents)
+        glfwPostEmptyEvent();
+    }
+  }
+}
+
+void startShaderReload ()
+{
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Hot reload: inotify unavailable\n");
+    return;
+  }
+
+  vector< pair<int, string> > watches;
+  for (size_t i = 0; i < shaderReload.programs.size(); i++)
+  {
+    WatchedProgram& watched = shaderReload.programs[i];
+    vector<string> vertexFiles, fragmentFiles;
+    preprocessShader(watched.vertexPath.c_str(), &vertexFiles);
+    preprocessShader(watched.fragmentPath.c_str(), &fragmentFiles);
+    watched.files = vertexFiles;
+    watched.files.insert(watched.files.end(), fragmentFiles.begin(), fragmentFiles.end());
+
+    for (size_t p = 0; p < watched.files.size(); p++)
+    {
+      string directory = directoryOf(watched.files[p]);
+      bool watched = false;
+      for (size_t w = 0; w < watches.size(); w++)
+        watched = watched || watches[w].second == directory;
+      int wd = watched ? -1 : inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+      if (wd >= 0)
+        watches.push_back(make_pair(wd, directory));
+    }
+  }
+
+  if (GLAD_GL_ARB_parallel_shader_compile)
+    glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+
+  shaderReload.inotifyFd = fd;
+  shaderReload.wakeFd = eventfd(0, EFD_CLOEXEC);
+  shaderReload.stopping = false;
+  shaderReload.watcher = thread(shaderWatcher, fd, watches);
+
+  // Any exit() still stops the watcher before the globals it uses go away
+  atexit(stopShaderReload);
+}
+
+/* Wake the watcher out of poll() and join it */
+void stopShaderReload ()
+{
+  if (!shaderReload.watcher.joinable())
+    return;
+  shaderReload.stopping = true;
+  uint64_t wake = 1;
+  if (write(shaderReload.wakeFd, &wake, sizeof(wake)) < 0)
+    perror("Hot reload");
+  shaderReload.watcher.join();
+  close(shaderReload.wakeFd);
+  close(shaderReload.inotifyFd);
+}
+
+void finishShaderReload (ReloadRequest& request)
+{
+  WatchedProgram& watched = shaderReload.programs[request.program];
+
+  GLint Result = GL_FALSE;
+  glGetProgramiv(request.ProgramID, GL_LINK_STATUS, &Result);
+  if (Result)
+  {
+    GLuint old = *watched.ProgramID;
+    *watched.ProgramID = request.ProgramID;
+    glDeleteProgram(old);
+    bindProgramResources();
+
+    // The state cache may still hold the deleted name
+    stateUseProgram(programID);
+    staticLayer.dirty = true;
+    partialRedraw.kept = false;
+    markDamage(DAMAGE_VIEW);
+
+    printf("Reloaded %s + %s\n", watched.vertexPath.c_str(), watched.fragmentPath.c_str());
+    if (programCache.enabled)
+      saveCachedProgram(programCachePath(request.vertexCode, request.fragmentCode), request.ProgramID);
+  }
+  else
+  {
+    printf("Reloading %s + %s failed, keeping the running program\n", watched.vertexPath.c_str(), watched.fragmentPath.c_str());
+    printShaderLog(request.VertexShaderID);
+    printShaderLog(request.FragmentShaderID);
+    printProgramLog(request.ProgramID);
+    glDeleteProgram(request.ProgramID);
+  }
+  glDeleteShader(request.VertexShaderID);
+  glDeleteShader(request.FragmentShaderID);
+}
+
+/* Called between frames - start compiling what the watcher read, swap in what has linked */
+void updateShaderReload ()
+{
+  vector<ReloadRequest> started;
+  {
+    lock_guard<mutex> guard(shaderReload.lock);
+    started.swap(shaderReload.ready);
   }
 
+  for (size_t i = 0; i < started.size(); i++)
+  {
+    ReloadRequest& request = started[i];
+    const char* vertexSource = request.vertexCode.c_str();
+    const char* fragmentSource = request.fragmentCode.c_str();
+
+    request.VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(request.VertexShaderID, 1, &vertexSource, NULL);
+    glCompileShader(request.VertexShaderID);
+    request.FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(request.FragmentShaderID, 1, &fragmentSource, NULL);
+    glCompileShader(request.FragmentShaderID);
+
+    request.ProgramID = glCreateProgram();
+    glAttachShader(request.ProgramID, request.VertexShaderID);
+    glAttachShader(request.ProgramID, request.FragmentShaderID);
+    if (programCache.enabled)
+      glProgramParameteri(request.ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(request.ProgramID);
+    shaderReload.compiling.push_back(request);
+  }
 
-  //cout << "x aftr collision = " << x_c << " y after collison " << y_c << " y speed =" << yspeed << " x speed = " << u*cos(angle) << "\n";
+  // Finish in order, so the last edit of a program is the one that stays
+  for (size_t i = 0; i < shaderReload.compiling.size(); )
+  {
+    GLint done = GL_TRUE;
+    if (GLAD_GL_ARB_parallel_shader_compile)
+      glGetProgramiv(shaderReload.compiling[i].ProgramID, GL_COMPLETION_STATUS_ARB, &done);
+    if (!done)
+      break;
+    finishShaderReload(shaderReload.compiling[i]);
+    shaderReload.compiling.erase(shaderReload.compiling.begin() + i);
+  }
+}
 
-  // if(triangle_translationX>70)
-  //   triangle_translationX=1;
+/* Frame pacing */
+/* --pacing=vsync (default) waits for the display, uncapped swaps as fast as
+   possible for benchmarks, and limit:<hz> runs unsynchronised but paces the
+   loop itself - it sleeps until LIMITER_SPIN before the deadline and spins the
+   rest, since sleeps overshoot by about a scheduler tick. Independently, a
+   fence per frame keeps the CPU at most --frames-in-flight frames ahead of
+   the GPU (0 to let the driver decide): fewer is lower latency, more is more
+   throughput. V cycles vsync, limit and uncapped while the game runs; the key
+   only records the mode and the renderer switches to it before its next frame,
+   since the swap interval belongs to the thread that owns the context. */
+#define LIMITER_SPIN 0.002  // seconds
+
+enum PacingMode {
+    PACING_UNCAPPED,
+    PACING_VSYNC,
+    PACING_LIMIT
+};
 
-  // else if (triangle_translationX<2)
-  // {
-  //   triangle_translationX=1;
-  // }
+struct Pacing {
+    PacingMode mode;
+    double targetHz;
+    double nextFrame;          // when the limiter lets the next frame start
+    int maxFramesInFlight;
+    deque<GLsync> inFlight;    // fences of the frames the GPU may still be working on
+    atomic<int> requested;     // mode asked for with the V key, only written by the input thread
+} pacing = { PACING_VSYNC, 60, 0, 2 };
+
+/* Ask for the next mode in the order vsync, limit, uncapped */
+void cyclePacing ()
+{
+    pacing.requested = (pacing.requested + 1) % 3;
+}
 
+/* Switch to the mode asked for, on the rendering thread */
+void updatePacing ()
+{
+    PacingMode mode = (PacingMode) pacing.requested.load();
+    if (mode == pacing.mode)
+        return;
+    pacing.mode = mode;
+    pacing.nextFrame = 0;
+    glfwSwapInterval( pacing.mode == PACING_VSYNC ? 1 : 0 );
+    if (pacing.mode == PACING_LIMIT)
+        printf("Pacing: limit %g fps\n", pacing.targetHz);
+    else
+        printf("Pacing: %s\n", pacing.mode == PACING_VSYNC ? "vsync" : "uncapped");
+}
 
+/* Block until fewer than maxFramesInFlight frames are queued on the GPU */
+void waitForFramesInFlight ()
+{
+    while (pacing.maxFramesInFlight > 0 && (int) pacing.inFlight.size() >= pacing.maxFramesInFlight) {
+        glClientWaitSync(pacing.inFlight.front(), GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(pacing.inFlight.front());
+        pacing.inFlight.pop_front();
+    }
+}
 
-  // printf("%d\n",triangle_translationX );
+void limitFrameRate ()
+{
+    double period = 1 / pacing.targetHz;
+    double now = currentTime();
+
+    // More than a frame late - start over rather than rush the frames we missed
+    if (now > pacing.nextFrame + period)
+        pacing.nextFrame = now;
+
+    double remaining = pacing.nextFrame - now;
+    if (remaining > LIMITER_SPIN) {
+        double sleep = remaining - LIMITER_SPIN;
+        timespec duration = { (time_t) sleep, (long) ((sleep - (time_t) sleep) * 1e9) };
+        nanosleep(&duration, NULL);
+    }
+    while (currentTime() < pacing.nextFrame)
+        ;
+
+    pacing.nextFrame += period;
+}
+
+/* Called once a frame has been handed to the display */
+void pacingEndFrame ()
+{
+    if (pacing.maxFramesInFlight > 0)
+        pacing.inFlight.push_back(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+
+    if (pacing.mode == PACING_LIMIT)
+        limitFrameRate();
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1207,6 +3929,7 @@ GLFWwindow* initGLFW (int width, int height)
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_DEPTH_BITS, 0);
 
     window = glfwCreateWindow(width, height, "Sample OpenGL 3.3 Application", NULL, NULL);
 
@@ -1217,7 +3940,7 @@ GLFWwindow* initGLFW (int width, int height)
 
     glfwMakeContextCurrent(window);
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    glfwSwapInterval( pacing.mode == PACING_VSYNC ? 1 : 0 );
 
     /* --- register callbacks with GLFW --- */
 
@@ -1229,6 +3952,7 @@ GLFWwindow* initGLFW (int width, int height)
 
     /* Register function to handle window close */
     glfwSetWindowCloseCallback(window, quit);
+    glfwSetWindowRefreshCallback(window, refreshWindow);
 
     /* Register function to handle keyboard input */
     glfwSetKeyCallback(window, keyboard);      // general keyboard input
@@ -1240,11 +3964,725 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
+/* Headless backend */
+/* --headless[=WxH] renders into an offscreen framebuffer of an EGL context
+   instead of opening a window, so no display or GPU is needed - Mesa's
+   llvmpipe will do. It runs --frames frames, optionally presses space after
+   --fire-at frames, then prints frame-time statistics and can save the last
+   frame with --output. */
+struct Headless {
+    bool enabled;
+    int width;
+    int height;
+    int frames;          // frames to render before exiting
+    int fireAt;          // frame after which space is pressed, -1 for never
+    string output;       // PPM of the last frame, empty for none
+
+    EGLDisplay display;
+    EGLContext context;
+    EGLSurface surface;
+    GLuint ColorBuffer;
+
+    int frame;
+    double lastTime;
+    vector<double> frameTimes;
+} headless = { false, 1920, 1080, 300, -1, "" };
+
+double currentTime ()
+{
+    if (!headless.enabled)
+        return glfwGetTime();
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Create an offscreen GL 3.3 core context and the framebuffer drawn into */
+void initHeadless (int width, int height)
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+
+    // Mesa's surfaceless platform needs neither X nor a GPU
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (display != EGL_NO_DISPLAY && !eglInitialize(display, NULL, NULL))
+            display = EGL_NO_DISPLAY;
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+            fprintf(stderr, "Headless: no EGL display\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    static const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    static const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    // The pbuffer only makes the context current, everything is drawn into the framebuffer below
+    static const EGLint surfaceAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+
+    EGLConfig config;
+    EGLint numConfigs;
+    if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0) {
+        fprintf(stderr, "Headless: no EGL config for desktop OpenGL\n");
+        exit(EXIT_FAILURE);
+    }
+
+    headless.display = display;
+    headless.surface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+    headless.context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (headless.context == EGL_NO_CONTEXT || !eglMakeCurrent(display, headless.surface, headless.surface, headless.context)) {
+        fprintf(stderr, "Headless: cannot create an OpenGL 3.3 core context\n");
+        exit(EXIT_FAILURE);
+    }
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    glGenFramebuffers (1, &screenFramebuffer);
+    glGenRenderbuffers (1, &headless.ColorBuffer);
+
+    glBindRenderbuffer (GL_RENDERBUFFER, headless.ColorBuffer);
+    glRenderbufferStorage (GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    stateBindFramebuffer (screenFramebuffer);
+    glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.ColorBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Headless: offscreen framebuffer incomplete\n");
+        exit(EXIT_FAILURE);
+    }
+    // initGL starts the state cache from framebuffer 0 and binds this one itself
+    stateBindFramebuffer (0);
+
+    headless.width = width;
+    headless.height = height;
+    headless.frame = 0;
+    headless.frameTimes.reserve(headless.frames);
+}
+
+/* Save the offscreen framebuffer as a binary PPM */
+void writeHeadlessFrame (const char* path)
+{
+    vector<GLubyte> pixels(3 * headless.width * headless.height);
+
+    stateBindFramebuffer (screenFramebuffer);
+    glPixelStorei (GL_PACK_ALIGNMENT, 1);
+    glReadPixels (0, 0, headless.width, headless.height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Headless: cannot write %s\n", path);
+        return;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", headless.width, headless.height);
+    // GL rows go bottom to top
+    for (int y = headless.height - 1; y >= 0; y--)
+        fwrite(&pixels[3 * headless.width * y], 1, 3 * headless.width, file);
+    fclose(file);
+}
+
+/* Print the frame-time statistics, save the last frame and exit */
+void finishHeadless ()
+{
+    if (!headless.output.empty())
+        writeHeadlessFrame(headless.output.c_str());
+
+    vector<double> times = headless.frameTimes;
+    sort(times.begin(), times.end());
+    double total = 0;
+    for (size_t i = 0; i < times.size(); i++)
+        total += times[i];
+
+    if (!times.empty()) {
+        double average = total / times.size();
+        printf("Headless: %d frames at %dx%d, %.1f fps\n", headless.frame, headless.width, headless.height, 1 / average);
+        printf("Frame time (ms): avg %.3f  min %.3f  median %.3f  p99 %.3f  max %.3f\n",
+               1000 * average, 1000 * times[0], 1000 * times[times.size() / 2],
+               1000 * times[min(times.size() - 1, times.size() * 99 / 100)], 1000 * times.back());
+    }
+
+    stopCapture();
+    stopShaderReload();
+    writeGpuProfile();
+    eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglTerminate(headless.display);
+    exit(EXIT_SUCCESS);
+}
+
+/* End of a headless frame - stands in for glfwSwapBuffers and glfwPollEvents */
+void presentHeadless ()
+{
+    // Wait for the frame, so the frame time covers rendering it and not only queueing it
+    glFinish();
+
+    double now = currentTime();
+    headless.frameTimes.push_back(now - headless.lastTime);
+    headless.lastTime = now;
+
+    headless.frame++;
+    if (headless.frame == headless.fireAt)
+        keyboardChar(NULL, ' ');
+    if (headless.frame >= headless.frames)
+        finishHeadless();
+}
+
+/* Frame capture */
+/* --capture=gameplay.y4m records a Y4M stream, any other path names a numbered
+   PPM sequence through one %d, %Nd or %0Nd (frame%05d.ppm), or gets %05d.ppm
+   appended if it has none. Each frame is read into one of CAPTURE_BUFFERS
+   pixel pack buffers without waiting, mapped CAPTURE_MAP_DELAY frames later,
+   when the read has long finished, and handed still mapped to a writer thread
+   that does all the copying, converting and writing. The renderer only issues
+   the read, maps and unmaps, and drops the frame if the writer has fallen
+   behind by all the buffers; headless runs wait for it instead. The cost
+   reported is the CPU time of the rendering thread, as the writer may share
+   its core. The
+   recording runs at CAPTURE_RATE whatever the pacing: a present that falls in
+   the same recorded frame as the one before is not read, and recorded frames
+   no present fell in - idle frames skipped by damage tracking, a slower
+   limit, dropped reads - repeat the frame before them. Headless frames are
+   one recorded frame each. The capture size is the framebuffer size when
+   capture starts, and resizing the window ends the capture. */
+#define CAPTURE_BUFFERS 6
+#define CAPTURE_RATE 60
+#define CAPTURE_MAP_DELAY 3   // the rest of the buffers are the writer's slack
+
+enum CaptureState {
+    CAPTURE_FREE,
+    CAPTURE_READING,   // glReadPixels issued, the renderer owns it
+    CAPTURE_MAPPED,    // queued for the writer
+    CAPTURE_WRITTEN    // writer done, the renderer unmaps it
+};
+
+struct CaptureSlot {
+    GLuint Buffer;
+    GLsync Fence;
+    CaptureState state;   // MAPPED and WRITTEN only change under capture.lock
+    const GLubyte* pixels;
+    int frame;
+    int index;            // recorded frame it starts at
+};
+
+struct Capture {
+    bool enabled;
+    string path;
+    bool y4m;
+    string prefix;        // PPM file names are prefix, frame number, suffix
+    string suffix;
+    int digits;           // zero padded to at least this many digits
+    FILE* stream;         // Y4M output
+    int width;
+    int height;
+    GLenum format;        // GL_RGBA or GL_BGRA, whichever the driver reads back without converting
+
+    CaptureSlot slots[CAPTURE_BUFFERS];
+    int next;             // slot the next frame is read into
+    int oldest;           // oldest slot that may still be READING
+    int frame;
+    int written;
+    int dropped;
+    int skipped;          // presents within the recorded frame of the one before
+    int waits;            // headless reads that waited for the writer to free a buffer
+    double mainThreadTime;   // CPU time of the rendering thread in captureFrame
+    double startTime;     // present time of recorded frame 0
+    int lastIndex;        // recorded frame of the newest read
+
+    vector<GLubyte> converted;   // the newest frame as PPM rows or Y4M planes, writer only
+    int lastWritten;             // its recorded frame, writer only
+
+    thread writer;
+    mutex lock;
+    condition_variable wake;
+    condition_variable finished;   // the writer is done with a slot
+    deque<int> queue;
+    bool stopping;
+} capture;
+
+/* Convert one frame - bottom-up RGBA or BGRA as read by glReadPixels */
+void convertCaptureFrame (const GLubyte* pixels)
+{
+    int width = capture.width, height = capture.height;
+    int red = capture.format == GL_BGRA ? 2 : 0, blue = 2 - red;
+    vector<GLubyte>& converted = capture.converted;
+
+    if (!capture.y4m) {
+        converted.resize(3 * width * height);
+        for (int y = 0; y < height; y++) {
+            const GLubyte* source = pixels + 4 * width * (height - 1 - y);
+            GLubyte* row = &converted[3 * width * y];
+            for (int x = 0; x < width; x++) {
+                row[3*x] = source[4*x + red];
+                row[3*x + 1] = source[4*x + 1];
+                row[3*x + 2] = source[4*x + blue];
+            }
+        }
+        return;
+    }
+
+    // BT.601 studio range, 4:2:0 with each chroma sample the average of a 2x2 block
+    int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+    converted.resize(width * height + 2 * chromaWidth * chromaHeight);
+    GLubyte* luma = &converted[0];
+    GLubyte* cb = luma + width * height;
+    GLubyte* cr = cb + chromaWidth * chromaHeight;
+
+    for (int y = 0; y < height; y++) {
+        const GLubyte* source = pixels + 4 * width * (height - 1 - y);
+        for (int x = 0; x < width; x++) {
+            int r = source[4*x + red], g = source[4*x + 1], b = source[4*x + blue];
+            luma[width * y + x] = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+        }
+    }
+    for (int y = 0; y < chromaHeight; y++) {
+        for (int x = 0; x < chromaWidth; x++) {
+            int r = 0, g = 0, b = 0;
+            for (int dy = 0; dy < 2; dy++) {
+                for (int dx = 0; dx < 2; dx++) {
+                    int sx = min(2*x + dx, width - 1), sy = min(2*y + dy, height - 1);
+                    const GLubyte* p = pixels + 4 * (width * (height - 1 - sy) + sx);
+                    r += p[red]; g += p[1]; b += p[blue];
+                }
+            }
+            r /= 4; g /= 4; b /= 4;
+            cb[chromaWidth * y + x] = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+            cr[chromaWidth * y + x] = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+        }
+    }
+}
+
+/* Write the converted frame as recorded frame index */
+void writeCaptureFrame (int index)
+{
+    if (capture.y4m) {
+        fputs("FRAME\n", capture.stream);
+        fwrite(&capture.converted[0], 1, capture.converted.size(), capture.stream);
+        return;
+    }
+
+    char name[1024];
+    snprintf(name, sizeof(name), "%s%0*d%s", capture.prefix.c_str(), capture.digits, index, capture.suffix.c_str());
+    FILE* file = fopen(name, "wb");
+    if (!file) {
+        fprintf(stderr, "Capture: cannot write %s\n", name);
+        return;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", capture.width, capture.height);
+    fwrite(&capture.converted[0], 1, capture.converted.size(), file);
+    fclose(file);
+}
+
+void captureWriter ()
+{
+    while (true) {
+        unique_lock<mutex> guard(capture.lock);
+        capture.wake.wait(guard, [] { return !capture.queue.empty() || capture.stopping; });
+        if (capture.queue.empty())
+            return;
+        int index = capture.queue.front();
+        capture.queue.pop_front();
+        guard.unlock();
+
+        // Recorded frames no read fell in hold the frame before
+        CaptureSlot& slot = capture.slots[index];
+        int frames = 0;
+        for (int i = capture.lastWritten + 1; capture.lastWritten >= 0 && i < slot.index; i++, frames++)
+            writeCaptureFrame(i);
+        convertCaptureFrame(slot.pixels);
+        writeCaptureFrame(slot.index);
+        capture.lastWritten = slot.index;
+
+        guard.lock();
+        slot.state = CAPTURE_WRITTEN;
+        capture.written += frames + 1;
+        capture.finished.notify_one();
+    }
+}
+
+/* Check the --capture path and split a PPM pattern around its frame number,
+   so nothing of the path is ever used as a format */
+bool parseCapturePath (const string& path)
+{
+    capture.path = path;
+    capture.y4m = path.size() > 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+    if (capture.y4m)
+        return true;
+
+    size_t percent = path.find('%');
+    if (percent == string::npos) {
+        capture.prefix = path;
+        capture.suffix = ".ppm";
+        capture.digits = 5;
+        return true;
+    }
+
+    size_t width = strspn(path.c_str() + percent + 1, "0123456789");
+    size_t conversion = percent + 1 + width;
+    if (width > 2 || conversion >= path.size() || path[conversion] != 'd' || path.find('%', conversion) != string::npos)
+        return false;
+    capture.prefix = path.substr(0, percent);
+    capture.suffix = path.substr(conversion + 1);
+    capture.digits = atoi(path.c_str() + percent + 1);
+    return true;
+}
+
+void startCapture (int width, int height)
+{
+    capture.width = width;
+    capture.height = height;
+
+    if (capture.y4m) {
+        capture.stream = fopen(capture.path.c_str(), "wb");
+        if (!capture.stream) {
+            fprintf(stderr, "Capture: cannot write %s\n", capture.path.c_str());
+            capture.enabled = false;
+            return;
+        }
+        fprintf(capture.stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, CAPTURE_RATE);
+    }
+
+    GLint readFormat = GL_RGBA;
+    glGetIntegerv (GL_IMPLEMENTATION_COLOR_READ_FORMAT, &readFormat);
+    capture.format = readFormat == GL_BGRA ? GL_BGRA : GL_RGBA;
+
+    for (int i = 0; i < CAPTURE_BUFFERS; i++) {
+        glGenBuffers (1, &capture.slots[i].Buffer);
+        stateBindBuffer (GL_PIXEL_PACK_BUFFER, capture.slots[i].Buffer);
+        glBufferData (GL_PIXEL_PACK_BUFFER, 4 * width * height, NULL, GL_STREAM_READ);
+        capture.slots[i].state = CAPTURE_FREE;
+    }
+    stateBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+
+    capture.next = capture.oldest = 0;
+    capture.frame = capture.written = capture.dropped = capture.skipped = capture.waits = 0;
+    capture.mainThreadTime = 0;
+    capture.lastIndex = capture.lastWritten = -1;
+    capture.stopping = false;
+    capture.writer = thread(captureWriter);
+
+    // Any exit() still flushes the frames in flight and joins the writer
+    atexit(stopCapture);
+}
+
+/* Map the finished reads in order and queue them for the writer */
+void handOverCaptures (bool wait)
+{
+    while (capture.slots[capture.oldest].state == CAPTURE_READING) {
+        CaptureSlot& slot = capture.slots[capture.oldest];
+        if (!wait && capture.frame - 1 - slot.frame < CAPTURE_MAP_DELAY)
+            break;
+        glClientWaitSync(slot.Fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(slot.Fence);
+
+        stateBindBuffer (GL_PIXEL_PACK_BUFFER, slot.Buffer);
+        slot.pixels = (const GLubyte*) glMapBufferRange (GL_PIXEL_PACK_BUFFER, 0, 4 * capture.width * capture.height, GL_MAP_READ_BIT);
+        {
+            lock_guard<mutex> guard(capture.lock);
+            slot.state = CAPTURE_MAPPED;
+            capture.queue.push_back(capture.oldest);
+        }
+        capture.wake.notify_one();
+        capture.oldest = (capture.oldest + 1) % CAPTURE_BUFFERS;
+    }
+    stateBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/* Unmap the buffers the writer is done with */
+void releaseCaptures ()
+{
+    bool written[CAPTURE_BUFFERS];
+    {
+        lock_guard<mutex> guard(capture.lock);
+        for (int i = 0; i < CAPTURE_BUFFERS; i++)
+            written[i] = capture.slots[i].state == CAPTURE_WRITTEN;
+    }
+    for (int i = 0; i < CAPTURE_BUFFERS; i++) {
+        if (!written[i])
+            continue;
+        stateBindBuffer (GL_PIXEL_PACK_BUFFER, capture.slots[i].Buffer);
+        glUnmapBuffer (GL_PIXEL_PACK_BUFFER);
+        capture.slots[i].state = CAPTURE_FREE;
+    }
+    stateBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/* CPU time of the calling thread, in seconds */
+double threadTime ()
+{
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Queue a read of the frame just rendered */
+void captureFrame ()
+{
+    double start = currentTime(), cpuStart = threadTime();
+
+    // The pixel buffers and the recording keep the size capture started at
+    if (framebufferWidth != capture.width || framebufferHeight != capture.height) {
+        printf("Capture: window resized to %dx%d, capture stopped\n", framebufferWidth, framebufferHeight);
+        stopCapture();
+        return;
+    }
+
+    releaseCaptures();
+
+    if (capture.frame == 0)
+        capture.startTime = start;
+    int index = headless.enabled ? capture.frame : (int) ((start - capture.startTime) * CAPTURE_RATE);
+
+    // A headless run has no deadline to keep, it waits for the writer rather than drop a frame
+    CaptureSlot& slot = capture.slots[capture.next];
+    if (headless.enabled && slot.state != CAPTURE_FREE) {
+        handOverCaptures(true);
+        {
+            unique_lock<mutex> guard(capture.lock);
+            capture.finished.wait(guard, [&slot] { return slot.state == CAPTURE_WRITTEN; });
+        }
+        releaseCaptures();
+        capture.waits++;
+    }
+
+    // Presents faster than CAPTURE_RATE leave the recorded frame to the first of them
+    if (index == capture.lastIndex)
+        capture.skipped++;
+    else if (slot.state == CAPTURE_FREE) {
+        stateBindBuffer (GL_PIXEL_PACK_BUFFER, slot.Buffer);
+        glPixelStorei (GL_PACK_ALIGNMENT, 4);
+        glReadPixels (0, 0, capture.width, capture.height, capture.format, GL_UNSIGNED_BYTE, (void*)0);
+        slot.Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.frame = capture.frame;
+        slot.index = capture.lastIndex = index;
+        slot.state = CAPTURE_READING;
+        capture.next = (capture.next + 1) % CAPTURE_BUFFERS;
+    }
+    else
+        capture.dropped++;
+    capture.frame++;
+
+    handOverCaptures(false);
+
+    capture.mainThreadTime += threadTime() - cpuStart;
+}
+
+/* Write out every frame still in flight and stop the writer */
+void stopCapture ()
+{
+    if (!capture.enabled)
+        return;
+    capture.enabled = false;
+
+    handOverCaptures(true);
+    {
+        lock_guard<mutex> guard(capture.lock);
+        capture.stopping = true;
+    }
+    capture.wake.notify_one();
+    capture.writer.join();
+    releaseCaptures();
+
+    if (capture.stream)
+        fclose(capture.stream);
+
+    printf("Capture: %d frames at %d fps written to %s, %d presents dropped, %d skipped, %d waited for the writer, "
+           "%.3f ms per frame on the rendering thread\n",
+           capture.written, CAPTURE_RATE, capture.path.c_str(), capture.dropped, capture.skipped, capture.waits,
+           capture.frame ? 1000 * capture.mainThreadTime / capture.frame : 0.0);
+}
+
+/* Render thread */
+/* The main thread runs the simulation: it handles input, calls draw() once per
+   tick and publishes the packet. A render thread that owns the GL context draws
+   the newest packet, presents it and paces itself, so a slow glfwSwapBuffers
+   never holds up input or physics, and a slow tick never holds up presenting.
+   Packets are handed over through a triple buffer: the simulation fills the
+   back packet and swaps it with the middle one, marking it fresh; the render
+   thread swaps its front packet with the middle one whenever it is fresh. Both
+   swaps are one atomic exchange, and a packet the renderer never got to is
+   simply overwritten. The simulation ticks at its own fixed rate - draw()
+   advances the game by a step per call - and the renderer only sleeps on the
+   lock while there is nothing new to draw. With --no-render-thread, and always
+   headless, the same packets are drawn by the main thread right after draw(). */
+#define PACKET_FRESH 4   // set in middle while it holds a packet not yet taken
+
+struct PacketExchange {
+    FramePacket packets[3];
+    int back;                 // filled by the simulation
+    atomic<int> middle;       // index of the last published packet, | PACKET_FRESH
+    int front;                // drawn by the renderer
+    mutex lock;               // only to sleep on while nothing is fresh
+    condition_variable published;
+} packetExchange;
+
+struct RenderThread {
+    bool enabled;
+    double tickHz;            // simulation rate, the game was tuned for 60
+    double nextTick;
+    GLFWwindow* window;
+    thread worker;
+    atomic<bool> stopping;
+    atomic<bool> idle;        // the simulation sleeps until an event arrives
+} renderThread = { true, 60 };
+
+atomic<int> framesPresented(0);
+
+void initPacketExchange ()
+{
+  packetExchange.back = 0;
+  packetExchange.middle = 1;
+  packetExchange.front = 2;
+}
+
+FramePacket& backPacket ()
+{
+  return packetExchange.packets[packetExchange.back];
+}
+
+bool packetFresh ()
+{
+  return (packetExchange.middle & PACKET_FRESH) != 0;
+}
+
+/* Hand the back packet to the renderer and take the middle one to fill next */
+void publishPacket ()
+{
+  packetExchange.back = packetExchange.middle.exchange(packetExchange.back | PACKET_FRESH) & 3;
+
+  // Taking the lock puts the notify after a renderer that just found nothing fresh has started waiting
+  { lock_guard<mutex> guard(packetExchange.lock); }
+  packetExchange.published.notify_one();
+}
+
+/* The newest published packet, or NULL if none arrives within timeout seconds */
+FramePacket* takePacket (double timeout)
+{
+  if (!packetFresh())
+  {
+    unique_lock<mutex> guard(packetExchange.lock);
+    packetExchange.published.wait_for(guard, chrono::duration<double>(timeout), packetFresh);
+    if (!packetFresh())
+      return NULL;
+  }
+  packetExchange.front = packetExchange.middle.exchange(packetExchange.front) & 3;
+  return &packetExchange.packets[packetExchange.front];
+}
+
+/* Draw a packet and put it on screen */
+void presentPacket (FramePacket& packet)
+{
+  renderPacket(packet);
+
+  if (capture.enabled)
+    captureFrame();
+
+  if (headless.enabled)
+    presentHeadless();
+  else
+    // Swap Frame Buffer in double buffering
+    glfwSwapBuffers(renderThread.window);
+
+  pacingEndFrame();
+  framesPresented++;
+
+  static double lastStats = 0;
+  double now = currentTime();
+  if (showGLStats && now - lastStats >= 0.5)
+  {
+    printf("GL calls per frame: %d issued, %d skipped, %d draws, %d indices, %d of %d obstacles culled, scene at %dx%d\n", glState.lastIssued, glState.lastSkipped, glState.lastDraws, glState.lastIndices, packet.numCulled, add, sceneWidth, sceneHeight);
+    lastStats = now;
+  }
+}
+
+/* Reloads and resolution changes between frames, on whichever thread owns the context */
+void updateRenderer ()
+{
+  // Keep the CPU from running too far ahead before drawing the next frame
+  waitForFramesInFlight();
+
+  // Pick up a pacing mode switched with the V key
+  if (!headless.enabled)
+    updatePacing();
+
+  // Swap in shaders edited since the last frame
+  if (shaderReload.enabled)
+    updateShaderReload();
+
+  // Rescale the scene from the GPU times measured so far
+  updateDynamicResolution();
+}
+
+void renderLoop ()
+{
+  glfwMakeContextCurrent(renderThread.window);
+  while (!renderThread.stopping)
+  {
+    updateRenderer();
+
+    // What the renderer damaged needs a packet from the simulation
+    if (renderThread.idle && sceneDamage != 0)
+      glfwPostEmptyEvent();
+
+    // Wake up now and then for reloads even while the game is idle
+    FramePacket* packet = takePacket(0.1);
+    if (packet)
+      presentPacket(*packet);
+  }
+  glfwMakeContextCurrent(NULL);
+}
+
+void startRenderThread ()
+{
+  // The context can only be current on one thread
+  glfwMakeContextCurrent(NULL);
+  renderThread.stopping = false;
+  renderThread.worker = thread(renderLoop);
+}
+
+/* Stop drawing and take the context back to the main thread */
+void stopRenderThread ()
+{
+  if (!renderThread.worker.joinable())
+    return;
+  renderThread.stopping = true;
+  renderThread.worker.join();
+  glfwMakeContextCurrent(renderThread.window);
+}
+
+/* Handle input until the next tick is due */
+void waitForNextTick ()
+{
+  double period = 1 / renderThread.tickHz;
+  double now = currentTime();
+
+  // Back from idling, or more than a tick late - start over rather than rush the missed ones
+  if (now > renderThread.nextTick + period)
+    renderThread.nextTick = now;
+
+  glfwPollEvents();
+  while ((now = currentTime()) < renderThread.nextTick)
+    glfwWaitEventsTimeout(renderThread.nextTick - now);
+
+  renderThread.nextTick += period;
+}
+
 /* Initialize the OpenGL rendering properties */
 /* Add all the models to be created here */
 void initGL (GLFWwindow* window, int width, int height)
 {
     /* Objects should be created before any other gl function and shaders */
+    initStateCache();
+    stateBindFramebuffer (screenFramebuffer);
+
 	// Create the models
 	drawCannon(0.0,0.0,0.0,0.05,360,false,false,0,0,0); // Generate the VAO, VBOs, vertices data & copy into the array buffer
 	createRectangle1 (-2.0, -2.0, 0.0, 0.5, 8);
@@ -1266,22 +4704,86 @@ void initGL (GLFWwindow* window, int width, int height)
   drawCircle4( -2.8, -2.0, 0, 0.4, 360, false, false, 0,0,0);
   drawCircle5( -2.8, -1.5, 0, 0.2, 360, false, false, 0,0,0);
 
+  if (obstacleMode == OBSTACLES_INSTANCED)
+    createObstacleBatch(360);
+  else if (obstacleMode == OBSTACLES_MULTIDRAW)
+    createMultiDrawBatch();
+
+  // Objects that never move, cached in the static layer
+  staticObjects[0] = rectangle2;
+  staticObjects[1] = rectangle3;
+  staticObjects[2] = rectangle4;
+  staticObjects[3] = rectangle5;
+  staticObjects[4] = rectangle6;
+  staticObjects[5] = circle4;
+  staticObjects[6] = circle5;
+  numStaticObjects = 7;
+  for (int i = 0; i < numStaticObjects; i++)
+    staticObjectLayers[i] = i < 4 ? LAYER_BACKGROUND : LAYER_SCENERY;  // the walls, then what sits on them
+  createStaticLayer();
+
+  // Offscreen target the scene is drawn into at a lower resolution when the GPU falls behind
+  createDynamicResolution();
+
+  // Timestamp queries of --gpu-profile
+  createGpuProfiler();
+
+	// Create and compile our GLSL program from the shaders, or load it from the cache
+	shaderDefines = "#define MAX_OBJECT_TRANSFORMS " + to_string(MAX_OBJECT_TRANSFORMS);
+	initProgramCache();
+	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
+	// Program for SDF circles, and the one used by the instanced obstacle batch
+	circleProgramID = LoadShaders( "Sample_GL.vert", "Circle_GL.frag" );
+	instancedProgramID = LoadShaders( "Instanced_GL.vert", sdfCircles ? "Circle_GL.frag" : "Sample_GL.frag" );
 
+	// The programs read their matrices from the "Camera" and "Transforms" uniform blocks
+	createTransformBuffers();
 
-	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Ring buffer for per-frame geometry, and the projectile trail drawn from it
+	createStreamBuffer();
+	createTrail();
+
+	// Program compositing the cached static layer
+	compositeProgramID = LoadShaders( "Composite_GL.vert", "Composite_GL.frag" );
+
+	// Impact particles, drawn instanced
+	particleRenderer.ProgramID = LoadShaders( "Particle_GL.vert", "Particle_GL.frag" );
+	createParticles();
+
+	// Program and font atlas of the HUD
+	if (hud.enabled)
+	{
+	  hud.ProgramID = LoadShaders( "Hud_GL.vert", "Hud_GL.frag" );
+	  createHud();
+	}
+
+	// Uniform blocks and locations, looked up again whenever a program is reloaded
+	bindProgramResources();
+
+	if (shaderReload.enabled)
+	{
+	  watchShaders(&programID, "Sample_GL.vert", "Sample_GL.frag");
+	  watchShaders(&circleProgramID, "Sample_GL.vert", "Circle_GL.frag");
+	  watchShaders(&instancedProgramID, "Instanced_GL.vert", sdfCircles ? "Circle_GL.frag" : "Sample_GL.frag");
+	  watchShaders(&compositeProgramID, "Composite_GL.vert", "Composite_GL.frag");
+	  watchShaders(&particleRenderer.ProgramID, "Particle_GL.vert", "Particle_GL.frag");
+	  if (hud.enabled)
+	    watchShaders(&hud.ProgramID, "Hud_GL.vert", "Hud_GL.frag");
+	  shaderReload.wakeEvents = window != NULL;
+	  startShaderReload();
+	}
 
 	
 	reshapeWindow (window, width, height);
 
     // Background color of the scene
 	glClearColor (0.0f, 1.0f, 1.0f, 0.0f); // R, G, B, A
-	glClearDepth (1.0f);
 
-	glEnable (GL_DEPTH_TEST);
-	glDepthFunc (GL_LEQUAL);
+	// Everything is at z = 0, the render queue layers draw back to front instead of a depth test
+	glDisable (GL_DEPTH_TEST);
+
+	// Only enabled for the SDF circles, see stateBlend
+	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     // cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
     // cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
@@ -1303,6 +4805,8 @@ void initvars()
   fla = 1;
   countt = 1;
   score = 0;
+  clearTrail();
+  markDamage(DAMAGE_ALL);
 }
 
 int main (int argc, char** argv)
@@ -1310,23 +4814,176 @@ int main (int argc, char** argv)
 	int width = 1920;
 	int height = 1080;
 
-  GLFWwindow* window = initGLFW(width, height);
+  for (int i = 1; i < argc; i++)
+  {
+    string arg = argv[i];
+    if (arg == "--no-instancing")
+      obstacleMode = OBSTACLES_SEPARATE;
+    else if (arg == "--obstacles=separate")
+      obstacleMode = OBSTACLES_SEPARATE;
+    else if (arg == "--obstacles=instanced")
+      obstacleMode = OBSTACLES_INSTANCED;
+    else if (arg == "--obstacles=multidraw")
+      obstacleMode = OBSTACLES_MULTIDRAW;
+    else if (arg == "--legacy-vertices")
+      compactVertices = false;
+    else if (arg == "--quantize-vertices")
+      quantizeVertices = true;
+    else if (arg == "--gl-stats")
+      showGLStats = true;
+    else if (arg == "--no-static-cache")
+      staticLayerEnabled = false;
+    else if (arg.compare(0, 12, "--particles=") == 0)
+      particleRenderer.burstSize = max(0, atoi(arg.c_str() + 12));
+    else if (arg == "--hot-reload")
+      shaderReload.enabled = true;
+    else if (arg == "--no-shader-cache")
+      programCache.enabled = false;
+    else if (arg.compare(0, 15, "--shader-cache=") == 0)
+      programCache.directory = arg.substr(15);
+    else if (arg == "--no-hud")
+      hud.enabled = false;
+    else if (arg == "--no-draw-sort")
+      sortDraws = false;
+    else if (arg == "--dynamic-resolution")
+      dynamicResolution.enabled = true;
+    else if (arg.compare(0, 21, "--dynamic-resolution=") == 0)
+    {
+      dynamicResolution.enabled = true;
+      dynamicResolution.targetMs = atof(arg.c_str() + 21);
+      if (dynamicResolution.targetMs <= 0)
+      {
+        fprintf(stderr, "Expected --dynamic-resolution=MS\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (arg == "--no-dynamic-resolution")
+      dynamicResolution.enabled = false;
+    else if (arg == "--gpu-profile")
+      gpuProfiler.enabled = true;
+    else if (arg.compare(0, 14, "--gpu-profile=") == 0)
+    {
+      gpuProfiler.enabled = true;
+      gpuProfiler.path = arg.substr(14);
+    }
+    else if (arg == "--no-render-thread")
+      renderThread.enabled = false;
+    else if (arg.compare(0, 12, "--tick-rate=") == 0)
+    {
+      renderThread.tickHz = atof(arg.c_str() + 12);
+      if (renderThread.tickHz <= 0)
+      {
+        fprintf(stderr, "Expected --tick-rate=HZ\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (arg == "--no-culling")
+      viewCullingEnabled = false;
+    else if (arg == "--no-damage-tracking")
+      damageTracking = false;
+    else if (arg == "--no-persistent-map")
+      persistentStreaming = false;
+    else if (arg == "--no-circle-lod")
+      circleLods = false;
+    else if (arg == "--fan-circles")
+      sdfCircles = false;
+    else if (arg == "--headless")
+      headless.enabled = true;
+    else if (arg.compare(0, 11, "--headless=") == 0)
+    {
+      headless.enabled = true;
+      if (sscanf(arg.c_str() + 11, "%dx%d", &headless.width, &headless.height) != 2 || headless.width <= 0 || headless.height <= 0)
+      {
+        fprintf(stderr, "Expected --headless=WIDTHxHEIGHT\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (arg.compare(0, 9, "--frames=") == 0)
+      headless.frames = max(1, atoi(arg.c_str() + 9));
+    else if (arg.compare(0, 10, "--fire-at=") == 0)
+      headless.fireAt = atoi(arg.c_str() + 10);
+    else if (arg.compare(0, 9, "--output=") == 0)
+      headless.output = arg.substr(9);
+    else if (arg == "--pacing=uncapped")
+      pacing.mode = PACING_UNCAPPED;
+    else if (arg == "--pacing=vsync")
+      pacing.mode = PACING_VSYNC;
+    else if (arg.compare(0, 15, "--pacing=limit:") == 0)
+    {
+      pacing.mode = PACING_LIMIT;
+      pacing.targetHz = atof(arg.c_str() + 15);
+      if (pacing.targetHz <= 0)
+      {
+        fprintf(stderr, "Expected --pacing=limit:HZ\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (arg.compare(0, 19, "--frames-in-flight=") == 0)
+      pacing.maxFramesInFlight = max(0, atoi(arg.c_str() + 19));
+    else if (arg.compare(0, 10, "--capture=") == 0)
+    {
+      capture.enabled = true;
+      if (!parseCapturePath(arg.substr(10)))
+      {
+        fprintf(stderr, "Expected --capture=NAME.y4m or a PPM pattern with one %%d, e.g. frame%%05d.ppm\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  pacing.requested = pacing.mode;
+
+  GLFWwindow* window = NULL;
+  if (headless.enabled)
+  {
+    width = headless.width;
+    height = headless.height;
+    initHeadless(width, height);
+    // Every frame is rendered, there is no one to wait for events from
+    damageTracking = false;
+    // Frames are drawn in step with the ticks that fire and finish the run
+    renderThread.enabled = false;
+  }
+  else
+    window = initGLFW(width, height);
 
 	initGL (window, width, height);
 
-    double last_update_time = glfwGetTime(), current_time;
+  if (capture.enabled)
+  {
+    int fbwidth = width, fbheight = height;
+    if (window)
+      glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    startCapture(fbwidth, fbheight);
+  }
+
+  initPacketExchange();
+  renderThread.window = window;
+  if (renderThread.enabled) {
+    startRenderThread();
+  }
+
+    double last_update_time = currentTime(), current_time;
+    int lastFramesPresented = 0;
+    headless.lastTime = last_update_time;
 
     /* Draw in loop */
     while(1)    
     {  
       initvars();
       GLfloat temp_x1 = -2.0, temp_y1 = -2.0, temp_x2, temp_y2;
+      unsigned lastDamage = DAMAGE_ALL;
 
-      while (!glfwWindowShouldClose(window)) {
+      while (headless.enabled || !glfwWindowShouldClose(window)) {
 
           
-          // OpenGL Draw commands
-          draw();
+          // Reloads, rescaling and waiting for the GPU, when the renderer runs on this thread
+          if (!renderThread.enabled)
+            updateRenderer();
+
+          // Advance the game and record the frame
+          FramePacket& packet = backPacket();
+          draw(packet);
 
           temp_x2 = x_c;
           temp_y2 = y_c;
@@ -1342,21 +4999,55 @@ int main (int argc, char** argv)
             temp_y1 = temp_y2;
           }
 
-          // Swap Frame Buffer in double buffering
-          glfwSwapBuffers(window);
+          // What draw() queued shows the state as of the last update, so a change
+          // is on screen only after the frame following it has been rendered too
+          unsigned damage = sceneDamage.exchange(0);
+          bool damaged = (damage | lastDamage) != 0 || !damageTracking;
+          lastDamage = damage;
 
-          // Poll for Keyboard and mouse events
-          glfwPollEvents();
+          if (damaged)
+          {
+            presentDamage |= damageTracking ? damage | lastDamage : DAMAGE_ALL;
+            publishPacket();
+
+            if (renderThread.enabled)
+              // Poll for Keyboard and mouse events until the next tick
+              waitForNextTick();
+            else
+            {
+              presentPacket(*takePacket(0));
+
+              // Poll for Keyboard and mouse events
+              if (!headless.enabled)
+                glfwPollEvents();
+            }
+          }
+          else
+          {
+            // Nothing changed - sleep until an event arrives instead of redrawing the same frame
+            renderThread.idle = true;
+            glfwWaitEventsTimeout(0.5);
+            renderThread.idle = false;
+          }
 
           // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-          current_time = glfwGetTime(); // Time in seconds
-          if ((current_time - last_update_time) >= 0.5) { // atleast 0.5s elapsed since last frame
+          current_time = currentTime(); // Time in seconds
+          double elapsed = current_time - last_update_time;
+          if (elapsed >= 0.5) { // atleast 0.5s elapsed since last frame
               // do something every 0.5 seconds ..
+              // Frame rate for the HUD, kept while idle so it does not wake the loop
+              int frames = framesPresented - lastFramesPresented;
+              if (frames)
+                hud.fps = frames / elapsed;
+              lastFramesPresented += frames;
               last_update_time = current_time;
           }
       }
     }
 
+    stopRenderThread();
+    stopShaderReload();
+    writeGpuProfile();
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,18 @@
+#version 330 core
+
+// Bitmap font, one channel
+uniform sampler2D font;
+uniform vec3 textColor;
+
+in vec2 fragTexel;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    // Glyphs are scaled by whole pixels, no filtering
+    if (texelFetch(font, ivec2(fragTexel), 0).r < 0.5)
+        discard;
+    color = textColor;
+}
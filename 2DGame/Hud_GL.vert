@@ -0,0 +1,15 @@
+#version 330 core
+
+// position in pixels from the top left, texel in the font atlas
+layout (location = 0) in vec4 vertex;
+
+// framebuffer size in pixels
+uniform vec2 screenSize;
+
+out vec2 fragTexel;
+
+void main ()
+{
+    fragTexel = vertex.zw;
+    gl_Position = vec4(vertex.x / screenSize.x * 2.0 - 1.0, 1.0 - vertex.y / screenSize.y * 2.0, 0, 1);
+}
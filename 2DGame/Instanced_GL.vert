@@ -0,0 +1,25 @@
+#version 330 core
+
+// input data : unit circle shared by all instances
+layout (location = 0) in vec2 vertexPosition;
+
+// per-instance data : centre x, centre y, radius, alive flag and colour
+layout (location = 2) in vec4 instanceCircle;
+layout (location = 3) in vec3 instanceColor;
+
+#include "Camera_GL.glsl"
+
+// output data : used by fragment shader
+out vec3 fragColor;
+out vec2 fragCircleCoord;
+
+void main ()
+{
+    // Scale the unit circle by the radius, dead instances collapse to a point
+    vec2 position = instanceCircle.xy + vertexPosition.xy * instanceCircle.z * instanceCircle.w;
+
+    fragColor = instanceColor;
+    fragCircleCoord = vertexPosition;
+
+    gl_Position = VP * vec4(position, 0, 1);
+}
@@ -0,0 +1,52 @@
+/* Microbenchmark of the particle step, make bench */
+/* Keeps the pool at a steady number of live particles the way the game does -
+   bursts of 512 with lives of 1 to 4 time units, stepped by tspeed - and times
+   each kernel over the same sequence of frames. Usage: particlebench [live] [frames] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "Particles.h"
+
+using namespace std;
+
+static ParticlePool pool;
+
+/* Top the pool up to live particles, as a stream of impacts would */
+static void refill (int live)
+{
+  while (pool.count < live && pool.count < PARTICLE_CAPACITY)
+    spawnParticleBurst(pool, 0, 0, 0xffffffffu, 512, 0.1f, 0.6f, 1.0f, 4.0f);
+}
+
+int main (int argc, char** argv)
+{
+  int live = argc > 1 ? atoi(argv[1]) : 100000;
+  int frames = argc > 2 ? atoi(argv[2]) : 1000;
+  const float tspeed = 0.08f, gravity = -2.0f / 5;
+
+  printf("%d live particles, %d frames, %.3f ms per frame at 60 Hz\n", live, frames, 1000.0 / 60);
+
+  for (int kernel = PARTICLES_SCALAR; kernel <= bestParticleKernel(); kernel++)
+  {
+    pool.count = 0;
+    pool.seed = 0;
+    refill(live);
+
+    double total = 0, worst = 0;
+    long long stepped = 0;
+    for (int frame = 0; frame < frames; frame++)
+    {
+      stepped += pool.count;
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      stepParticles(pool, tspeed, gravity, (ParticleKernel) kernel);
+      double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+      total += elapsed;
+      worst = elapsed > worst ? elapsed : worst;
+      refill(live);
+    }
+
+    printf("%-6s  %.3f ms per frame (worst %.3f), %.2f ns per particle\n", particleKernelNames[kernel],
+           total / frames, worst, total * 1e6 / stepped);
+  }
+  return 0;
+}
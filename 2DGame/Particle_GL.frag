@@ -0,0 +1,16 @@
+#version 330 core
+
+in vec4 fragColor;
+in vec2 fragCorner;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Round, soft towards the edge
+    float d = dot(fragCorner, fragCorner);
+    if (d > 1.0)
+        discard;
+    color = vec4(fragColor.rgb, fragColor.a * (1.0 - d));
+}
@@ -0,0 +1,27 @@
+#version 330 core
+
+// input data : quad corner shared by all instances
+layout (location = 0) in vec2 corner;
+
+// per-instance data, one array each : position, time left and colour
+layout (location = 1) in float x;
+layout (location = 2) in float y;
+layout (location = 3) in float life;
+layout (location = 4) in vec4 color;
+
+#include "Camera_GL.glsl"
+
+// radius in world units
+const float size = 0.03;
+
+out vec4 fragColor;
+out vec2 fragCorner;
+
+void main ()
+{
+    // Fade out over the last unit of time
+    fragColor = vec4(color.rgb, color.a * clamp(life, 0.0, 1.0));
+    fragCorner = corner;
+
+    gl_Position = VP * vec4(vec2(x, y) + corner * size, 0, 1);
+}
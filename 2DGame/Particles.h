@@ -0,0 +1,193 @@
+/* Particle pool for the impact bursts */
+/* Structure of arrays in one fixed-capacity pool, so a step runs over contiguous
+   floats, 4 particles at a time with SSE or 8 with AVX. Live particles are kept at
+   the front of the arrays: after a step the dead ones are replaced, starting at
+   the first one the kernel saw die. Used by Game.cpp and ParticleBench.cpp. */
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARTICLES_X86 1
+#endif
+
+#define PARTICLE_CAPACITY (128*1024)  // a multiple of 8, the kernels round the count up
+
+struct ParticlePool {
+    alignas(32) float x[PARTICLE_CAPACITY];
+    alignas(32) float y[PARTICLE_CAPACITY];
+    alignas(32) float vx[PARTICLE_CAPACITY];
+    alignas(32) float vy[PARTICLE_CAPACITY];
+    alignas(32) float life[PARTICLE_CAPACITY];   // time left, dead at 0
+    alignas(32) uint32_t color[PARTICLE_CAPACITY];  // RGBA8, as uploaded
+    int count;
+    uint32_t seed;
+};
+
+enum ParticleKernel {
+    PARTICLES_SCALAR,
+    PARTICLES_SSE,
+    PARTICLES_AVX
+};
+
+static const char* particleKernelNames[] = { "scalar", "SSE", "AVX" };
+
+/* The kernels advance every particle by dt under constant gravity and return the
+   index of the first one that died, count if none did */
+static inline int integrateParticlesScalar (ParticlePool& pool, float dt, float gravity)
+{
+  int firstDead = pool.count;
+  for (int i = 0; i < pool.count; i++)
+  {
+    pool.x[i] += pool.vx[i] * dt;
+    pool.y[i] += (pool.vy[i] + 0.5f * gravity * dt) * dt;
+    pool.vy[i] += gravity * dt;
+    pool.life[i] -= dt;
+    if (pool.life[i] <= 0 && firstDead == pool.count)
+      firstDead = i;
+  }
+  return firstDead;
+}
+
+#ifdef PARTICLES_X86
+static inline int integrateParticlesSSE (ParticlePool& pool, float dt, float gravity)
+{
+  __m128 step = _mm_set1_ps(dt);
+  __m128 fall = _mm_set1_ps(gravity * dt);
+  __m128 halfFall = _mm_set1_ps(0.5f * gravity * dt);
+  __m128 zero = _mm_setzero_ps();
+
+  int firstDead = pool.count;
+  for (int i = 0; i < pool.count; i += 4)
+  {
+    __m128 vy = _mm_load_ps(pool.vy + i);
+    _mm_store_ps(pool.x + i, _mm_add_ps(_mm_load_ps(pool.x + i), _mm_mul_ps(_mm_load_ps(pool.vx + i), step)));
+    _mm_store_ps(pool.y + i, _mm_add_ps(_mm_load_ps(pool.y + i), _mm_mul_ps(_mm_add_ps(vy, halfFall), step)));
+    _mm_store_ps(pool.vy + i, _mm_add_ps(vy, fall));
+
+    __m128 life = _mm_sub_ps(_mm_load_ps(pool.life + i), step);
+    _mm_store_ps(pool.life + i, life);
+    int dead = _mm_movemask_ps(_mm_cmple_ps(life, zero));
+    if (dead && firstDead == pool.count)
+      firstDead = i + __builtin_ctz(dead);
+  }
+  // Lanes past the end are not particles
+  return firstDead < pool.count ? firstDead : pool.count;
+}
+
+__attribute__((target("avx")))
+static inline int integrateParticlesAVX (ParticlePool& pool, float dt, float gravity)
+{
+  __m256 step = _mm256_set1_ps(dt);
+  __m256 fall = _mm256_set1_ps(gravity * dt);
+  __m256 halfFall = _mm256_set1_ps(0.5f * gravity * dt);
+  __m256 zero = _mm256_setzero_ps();
+
+  int firstDead = pool.count;
+  for (int i = 0; i < pool.count; i += 8)
+  {
+    __m256 vy = _mm256_load_ps(pool.vy + i);
+    _mm256_store_ps(pool.x + i, _mm256_add_ps(_mm256_load_ps(pool.x + i), _mm256_mul_ps(_mm256_load_ps(pool.vx + i), step)));
+    _mm256_store_ps(pool.y + i, _mm256_add_ps(_mm256_load_ps(pool.y + i), _mm256_mul_ps(_mm256_add_ps(vy, halfFall), step)));
+    _mm256_store_ps(pool.vy + i, _mm256_add_ps(vy, fall));
+
+    __m256 life = _mm256_sub_ps(_mm256_load_ps(pool.life + i), step);
+    _mm256_store_ps(pool.life + i, life);
+    int dead = _mm256_movemask_ps(_mm256_cmp_ps(life, zero, _CMP_LE_OQ));
+    if (dead && firstDead == pool.count)
+      firstDead = i + __builtin_ctz(dead);
+  }
+  return firstDead < pool.count ? firstDead : pool.count;
+}
+#endif
+
+/* The widest kernel this CPU runs */
+static inline ParticleKernel bestParticleKernel ()
+{
+#ifdef PARTICLES_X86
+  if (__builtin_cpu_supports("avx"))
+    return PARTICLES_AVX;
+  return PARTICLES_SSE;
+#else
+  return PARTICLES_SCALAR;
+#endif
+}
+
+/* Fill the slot of every dead particle from first on with the last particle.
+   Only a few die each frame, so this moves far less than shifting down would;
+   the order of the particles does not matter. */
+static inline void removeDeadParticles (ParticlePool& pool, int first)
+{
+  for (int i = first; i < pool.count; )
+  {
+    if (pool.life[i] > 0)
+    {
+      i++;
+      continue;
+    }
+    int last = --pool.count;
+    pool.x[i] = pool.x[last];
+    pool.y[i] = pool.y[last];
+    pool.vx[i] = pool.vx[last];
+    pool.vy[i] = pool.vy[last];
+    pool.life[i] = pool.life[last];
+    pool.color[i] = pool.color[last];
+  }
+}
+
+static inline void stepParticles (ParticlePool& pool, float dt, float gravity, ParticleKernel kernel)
+{
+  int firstDead;
+  switch (kernel) {
+#ifdef PARTICLES_X86
+    case PARTICLES_AVX:
+      firstDead = integrateParticlesAVX(pool, dt, gravity);
+      break;
+    case PARTICLES_SSE:
+      firstDead = integrateParticlesSSE(pool, dt, gravity);
+      break;
+#endif
+    default:
+      firstDead = integrateParticlesScalar(pool, dt, gravity);
+      break;
+  }
+  if (firstDead < pool.count)
+    removeDeadParticles(pool, firstDead);
+}
+
+/* xorshift32, uniform in [0, 1) - bursts are the same on every run */
+static inline float particleRandom (ParticlePool& pool)
+{
+  pool.seed ^= pool.seed << 13;
+  pool.seed ^= pool.seed >> 17;
+  pool.seed ^= pool.seed << 5;
+  return (pool.seed >> 8) * (1.0f / 16777216);
+}
+
+/* Up to n particles flying out of (x, y) in all directions, fewer if the pool is full */
+static inline void spawnParticleBurst (ParticlePool& pool, float x, float y, uint32_t color, int n,
+                                       float minSpeed, float maxSpeed, float minLife, float maxLife)
+{
+  if (pool.seed == 0)
+    pool.seed = 2463534242u;
+  if (n > PARTICLE_CAPACITY - pool.count)
+    n = PARTICLE_CAPACITY - pool.count;
+
+  for (int i = pool.count; i < pool.count + n; i++)
+  {
+    float angle = particleRandom(pool) * 2 * (float) M_PI;
+    float speed = minSpeed + particleRandom(pool) * (maxSpeed - minSpeed);
+    pool.x[i] = x;
+    pool.y[i] = y;
+    pool.vx[i] = cosf(angle) * speed;
+    pool.vy[i] = sinf(angle) * speed;
+    pool.life[i] = minLife + particleRandom(pool) * (maxLife - minLife);
+    pool.color[i] = color;
+  }
+  pool.count += n;
+}
+
+#endif
@@ -1,22 +1,37 @@
 #version 330 core
 
 // input data : sent from main program
-layout (location = 0) in vec3 vertexPosition;
+layout (location = 0) in vec2 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
 
-uniform mat4 MVP;
+// position inside an SDF circle, in radii
+layout (location = 2) in vec2 circleCoord;
+
+// index of this object's transform in the Transforms block
+layout (location = 3) in int objectIndex;
+
+#include "Camera_GL.glsl"
+
+// per-object 2D transforms, two rows of a 2x3 affine matrix each
+layout (std140) uniform Transforms {
+    vec4 model[2*MAX_OBJECT_TRANSFORMS];
+};
 
 // output data : used by fragment shader
 out vec3 fragColor;
+out vec2 fragCircleCoord;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    vec3 p = vec3(vertexPosition, 1);
+    vec2 position = vec2(dot(model[2*objectIndex].xyz, p), dot(model[2*objectIndex + 1].xyz, p));
+    vec4 v = vec4(position, 0, 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
     fragColor = vertexColor;
+    fragCircleCoord = circleCoord;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * Model * position
+    gl_Position = VP * v;
 }